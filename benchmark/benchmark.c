@@ -6,23 +6,21 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <string.h>
 #include <sys/wait.h>
+#include "trace.h"
 
 int main(int argc, char *argv[])
 {
     int i=0,number_of_processes = 1, number_of_objects=1024, max_size_of_objects = 8192 ,j; 
     int a;
-    int pid;
+    int pid = 1; // This should be initialized to make sure the for loop is executed.
     int size;
     char data[8192];
-    char filename[256];
     char *mapped_data;
     int devfd;
     unsigned long long msec_time;
     FILE *fp;
-    struct timeval current_time;
     if(argc < 3)
     {
         fprintf(stderr, "Usage: %s number_of_objects max_size_of_objects number_of_processes\n",argv[0]);
@@ -31,7 +29,7 @@ int main(int argc, char *argv[])
     number_of_objects = atoi(argv[1]);
     max_size_of_objects = atoi(argv[2]);
     number_of_processes = atoi(argv[3]);
-    devfd = open("/dev/npheap",O_RDWR);
+    devfd = npheap_open(NPHEAP_BACKEND_DEFAULT);
     if(devfd < 0)
     {
         fprintf(stderr, "Device open failed");
@@ -43,8 +41,7 @@ int main(int argc, char *argv[])
         pid=fork();
         srand((int)time(NULL)+(int)getpid());
     }
-    sprintf(filename,"npheap.%d.log",(int)getpid());
-    fp = fopen(filename,"w");
+    fp = trace_open();
     for(i = 0; i < number_of_objects; i++)
     {
         npheap_lock(devfd,i);
@@ -61,12 +58,11 @@ int main(int argc, char *argv[])
         }
         memset(mapped_data, 0, size);
         a = rand()+1;
-        gettimeofday(&current_time, NULL);
         for(j = 0; j < size-10; j=strlen(mapped_data))
         {
             sprintf(mapped_data,"%s%d",mapped_data,a);
         }
-        fprintf(fp,"S\t%d\t%ld\t%d\t%lu\t%s\n",pid,current_time.tv_sec * 1000000 + current_time.tv_usec,i,strlen(mapped_data),mapped_data);
+        trace_write(fp, 'S', i, mapped_data);
         npheap_unlock(devfd,i);
     }
     
@@ -74,11 +70,13 @@ int main(int argc, char *argv[])
     i = rand()%256;
     npheap_lock(devfd,i);
     npheap_delete(devfd,i);
-    fprintf(fp,"D\t%d\t%ld\t%d\t%lu\t%s\n",pid,current_time.tv_sec * 1000000 + current_time.tv_usec,i,strlen(mapped_data),mapped_data);
+    trace_write(fp, 'D', i, NULL);
     npheap_unlock(devfd,i);
     close(devfd);
+    fclose(fp);
     if(pid != 0)
-        wait(NULL);
+        for(i = 0; i < number_of_processes - 1; i++)
+            wait(NULL);
     return 0;
 }
 
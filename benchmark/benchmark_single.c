@@ -6,9 +6,9 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
-#include <sys/time.h>
 #include <string.h>
 #include <sys/wait.h>
+#include "trace.h"
 
 #define LOCK_UNLOCK_ALLOC  2
 #define LOCK_UNLOCK_DELETE  3
@@ -17,6 +17,9 @@
 #define NO_WRITE_LOCK_UNLOCK_DELETE  6
 #define NO_WRITE_LOCK_UNLOCK_GETSIZE 7
 #define NO_WRITE_LOCK_UNLOCK_DELETE_GETSIZE 8
+#define LOOKUP_SCALING 9
+
+#define LOOKUP_PROBES 100000
 
 //#define DEBUG 1
 
@@ -27,12 +30,10 @@ int main(int argc, char *argv[])
     int pid = 1; // This should be initialized to make sure the for loop is executed.
     int size = 0;
     char data[8192];
-    char filename[256];
     char *mapped_data = NULL;
     int devfd;
     unsigned long long msec_time;
     FILE *fp;
-    struct timeval current_time;
     //if(argc < 3)
     //{
     //    fprintf(stderr, "Usage: %s number_of_objects max_size_of_objects number_of_processes\n",argv[0]);
@@ -51,7 +52,7 @@ int main(int argc, char *argv[])
     max_size_of_objects = atoi(argv[2]);
     feature_combination = atoi(argv[3]);
     number_of_processes = atoi(argv[4]);
-    devfd = open("/dev/npheap",O_RDWR);
+    devfd = npheap_open(NPHEAP_BACKEND_DEFAULT);
     if(devfd < 0)
     {
         fprintf(stderr, "Device open failed");
@@ -64,8 +65,7 @@ int main(int argc, char *argv[])
         srand((int)time(NULL)+(int)getpid());
     }
     // printf("Pid: %d\n", (int)getpid());
-    sprintf(filename,"npheap.%d.log",(int)getpid());
-    fp = fopen(filename,"w");
+    fp = trace_open();
     if (fp == NULL)
     {
         printf("Log file open failed.\n");
@@ -93,12 +93,11 @@ int main(int argc, char *argv[])
             }
             memset(mapped_data, 0, size);
             a = rand()+1;
-            gettimeofday(&current_time, NULL);
             for(j = 0; j < size-10; j=strlen(mapped_data))
             {
                 sprintf(mapped_data,"%s%d",mapped_data,a);
             }
-            fprintf(fp,"S\t%d\t%ld\t%d\t%lu\t%s\n",pid,current_time.tv_sec * 1000000 + current_time.tv_usec,i,strlen(mapped_data),mapped_data);
+            trace_write(fp, 'S', i, mapped_data);
             npheap_unlock(devfd,i);
         }
    #ifdef DEBUG
@@ -106,6 +105,38 @@ int main(int argc, char *argv[])
    #endif
     }
 
+    // Grow the heap to number_of_objects, doubling each round, and time
+    // random getsize() lookups after every round. With a scalable index
+    // the per-lookup cost should stay flat as the object count grows.
+    if (feature_combination == LOOKUP_SCALING)
+    {
+        int populated = 0, target;
+        struct timespec start, end;
+        double nsec;
+        printf("objects\tns_per_lookup\n");
+        for (target = 1024; populated < number_of_objects; target *= 2)
+        {
+            if (target > number_of_objects)
+                target = number_of_objects;
+            for (; populated < target; populated++)
+            {
+                mapped_data = (char *)npheap_alloc(devfd, populated, getpagesize());
+                if (mapped_data == MAP_FAILED)
+                {
+                    fprintf(stderr,"Failed in npheap_alloc()\n");
+                    exit(1);
+                }
+                npheap_release(devfd, populated);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (j = 0; j < LOOKUP_PROBES; j++)
+                npheap_getsize(devfd, rand() % populated);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            nsec = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+            printf("%d\t%.1f\n", populated, nsec / LOOKUP_PROBES);
+        }
+    }
+
     // For three of the feature definition, no data will be written to the heap.
     if ((feature_combination == LOCK_UNLOCK_DELETE) || (feature_combination == LOCK_UNLOCK_GETSIZE) || (feature_combination == LOCK_UNLOCK_DELETE_GETSIZE))
     {
@@ -128,12 +159,11 @@ int main(int argc, char *argv[])
             }
             memset(mapped_data, 0, size);
             a = rand()+1;
-            gettimeofday(&current_time, NULL);
             for(j = 0; j < size-10; j=strlen(mapped_data))
             {
                 sprintf(mapped_data,"%s%d",mapped_data,a);
             }
-            fprintf(fp,"S\t%d\t%ld\t%d\t%lu\t%s\n",pid,current_time.tv_sec * 1000000 + current_time.tv_usec,i,strlen(mapped_data),mapped_data);
+            trace_write(fp, 'S', i, mapped_data);
             npheap_unlock(devfd,i);
         }
     }
@@ -155,25 +185,23 @@ int main(int argc, char *argv[])
 #ifdef DEBUG
     printf("Before delete.");
 #endif
-        gettimeofday(&current_time, NULL);
         npheap_delete(devfd, i);
 #ifdef DEBUG
     printf("After delete.");
 #endif
-        fprintf(fp,"D\t%d\t%ld\t%d\t%lu\t%s\n",pid,current_time.tv_sec * 1000000 + current_time.tv_usec,i,strlen(mapped_data),mapped_data);
+        trace_write(fp, 'D', i, NULL);
         npheap_unlock(devfd, i);
     }
     // try get size
     else if ((feature_combination == NO_WRITE_LOCK_UNLOCK_GETSIZE) || (feature_combination == LOCK_UNLOCK_GETSIZE) || (feature_combination == NO_WRITE_LOCK_UNLOCK_DELETE_GETSIZE) || (feature_combination == LOCK_UNLOCK_DELETE_GETSIZE))
     {
         i = rand() % number_of_objects;
-        npheap_lock(devfd, i);
-        gettimeofday(&current_time, NULL);
+        npheap_rdlock(devfd, i);
         size = npheap_getsize(devfd, i);
 	if (size != 0)
         {
             mapped_data = (char *)npheap_alloc(devfd,i,size);
-            fprintf(fp,"G\t%d\t%ld\t%d\t%lu\t%s\n",pid,current_time.tv_sec * 1000000 + current_time.tv_usec,i,strlen(mapped_data),mapped_data);
+            trace_write(fp, 'G', i, mapped_data);
         }
         npheap_unlock(devfd, i);
 
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <npheap.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Measures each NPHeap operation on its own and prints one CSV line per
+// operation and worker count:
+//
+//   mode,workers,op,count,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns
+//
+// Every worker repeatedly takes its own objects through alloc (the first
+// mmap of a new object), first touch of every page, lock, getsize,
+// unlock and delete, so the numbers show the cost of each operation
+// rather than contention between workers. ops_per_sec is the combined
+// rate of all workers while they were performing that operation. The
+// worker count doubles from 1 up to max_workers; workers are processes
+// or, with "t", threads of one process.
+
+#define OP_ALLOC   0
+#define OP_TOUCH   1
+#define OP_LOCK    2
+#define OP_GETSIZE 3
+#define OP_UNLOCK  4
+#define OP_DELETE  5
+#define NR_OPS     6
+
+static const char *op_names[NR_OPS] = {"alloc", "first_touch", "lock", "getsize", "unlock", "delete"};
+
+// Latencies are bucketed by their top five significant bits: each power
+// of two is split into 16 linear buckets, which keeps percentiles within
+// about 6% of the real value.
+#define SUB_BITS    4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define NR_BUCKETS  (64 * SUB_BUCKETS)
+
+struct histogram
+{
+    unsigned long long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long buckets[NR_BUCKETS];
+};
+
+struct shared
+{
+    pthread_barrier_t start;
+    struct histogram hist[];    // workers * NR_OPS
+};
+
+static int number_of_objects, object_size, iterations;
+static struct shared *shared;
+static int devfd;
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(unsigned long long ns)
+{
+    int e;
+    if (ns < SUB_BUCKETS)
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + ((ns >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+// Smallest value that falls into bucket b, used when reporting.
+static unsigned long long bucket_value(int b)
+{
+    int e;
+    if (b < SUB_BUCKETS)
+        return b;
+    e = b / SUB_BUCKETS + SUB_BITS - 1;
+    return (1ULL << e) + ((unsigned long long)(b % SUB_BUCKETS) << (e - SUB_BITS));
+}
+
+static void record(struct histogram *h, unsigned long long start)
+{
+    unsigned long long ns = now_ns() - start;
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+    h->buckets[bucket_of(ns)]++;
+}
+
+static unsigned long long percentile(struct histogram *h, double p)
+{
+    unsigned long long seen = 0, want = (unsigned long long)(h->count * p);
+    int b;
+    for (b = 0; b < NR_BUCKETS; b++)
+    {
+        seen += h->buckets[b];
+        if (seen > want)
+            return bucket_value(b);
+    }
+    return h->max_ns;
+}
+
+static void run_worker(int worker)
+{
+    struct histogram *hist = &shared->hist[worker * NR_OPS];
+    __u64 base = (__u64)worker * number_of_objects, offset;
+    unsigned long long start;
+    char *data;
+    int i, it, page;
+
+    pthread_barrier_wait(&shared->start);
+    for (it = 0; it < iterations; it++)
+    {
+        for (i = 0; i < number_of_objects; i++)
+        {
+            offset = base + i;
+            start = now_ns();
+            data = npheap_alloc(devfd, offset, object_size);
+            record(&hist[OP_ALLOC], start);
+            if (data == MAP_FAILED || !data)
+            {
+                fprintf(stderr, "Failed in npheap_alloc()\n");
+                exit(1);
+            }
+            start = now_ns();
+            for (page = 0; page < object_size; page += getpagesize())
+                data[page] = 1;
+            record(&hist[OP_TOUCH], start);
+        }
+        for (i = 0; i < number_of_objects; i++)
+        {
+            offset = base + i;
+            start = now_ns();
+            npheap_lock(devfd, offset);
+            record(&hist[OP_LOCK], start);
+            start = now_ns();
+            npheap_getsize(devfd, offset);
+            record(&hist[OP_GETSIZE], start);
+            start = now_ns();
+            npheap_unlock(devfd, offset);
+            record(&hist[OP_UNLOCK], start);
+        }
+        for (i = 0; i < number_of_objects; i++)
+        {
+            start = now_ns();
+            npheap_delete(devfd, base + i);
+            record(&hist[OP_DELETE], start);
+        }
+    }
+}
+
+static void *run_thread(void *arg)
+{
+    run_worker((int)(long)arg);
+    return NULL;
+}
+
+static void report(const char *mode, int workers)
+{
+    struct histogram total;
+    struct histogram *h;
+    int op, w, b;
+    for (op = 0; op < NR_OPS; op++)
+    {
+        memset(&total, 0, sizeof(total));
+        for (w = 0; w < workers; w++)
+        {
+            h = &shared->hist[w * NR_OPS + op];
+            total.count += h->count;
+            total.total_ns += h->total_ns;
+            if (h->max_ns > total.max_ns)
+                total.max_ns = h->max_ns;
+            for (b = 0; b < NR_BUCKETS; b++)
+                total.buckets[b] += h->buckets[b];
+        }
+        if (!total.count)
+            continue;
+        printf("%s,%d,%s,%llu,%.0f,%llu,%llu,%llu,%llu\n", mode, workers, op_names[op], total.count,
+               total.total_ns ? total.count * 1e9 * workers / total.total_ns : 0.0,
+               percentile(&total, 0.5), percentile(&total, 0.99), percentile(&total, 0.999), total.max_ns);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_workers, workers, w, threads;
+    size_t shared_size;
+    pthread_barrierattr_t attr;
+    pthread_t *tids;
+    const char *mode;
+    if(argc < 5)
+    {
+        fprintf(stderr, "Usage: %s number_of_objects object_size iterations max_workers [p|t]\n",argv[0]);
+        exit(1);
+    }
+    number_of_objects = atoi(argv[1]);
+    object_size = atoi(argv[2]);
+    iterations = atoi(argv[3]);
+    max_workers = atoi(argv[4]);
+    threads = argc > 5 && argv[5][0] == 't';
+    mode = threads ? "threads" : "processes";
+    if (number_of_objects <= 0 || object_size <= 0 || iterations <= 0 || max_workers <= 0)
+    {
+        fprintf(stderr, "All arguments must be positive\n");
+        exit(1);
+    }
+    devfd = npheap_open(NPHEAP_BACKEND_DEFAULT);
+    if(devfd < 0)
+    {
+        fprintf(stderr, "Device open failed");
+        exit(1);
+    }
+    shared_size = sizeof(*shared) + (size_t)max_workers * NR_OPS * sizeof(struct histogram);
+    shared = mmap(0, shared_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    tids = calloc(max_workers, sizeof(pthread_t));
+    if (shared == MAP_FAILED || !tids)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    printf("mode,workers,op,count,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+    fflush(stdout);
+    for (workers = 1; workers <= max_workers; workers = workers < max_workers && workers * 2 > max_workers ? max_workers : workers * 2)
+    {
+        memset(shared->hist, 0, (size_t)workers * NR_OPS * sizeof(struct histogram));
+        pthread_barrierattr_init(&attr);
+        pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_barrier_init(&shared->start, &attr, workers);
+        pthread_barrierattr_destroy(&attr);
+        for (w = 0; w < workers; w++)
+        {
+            if (threads)
+                pthread_create(&tids[w], NULL, run_thread, (void *)(long)w);
+            else if (fork() == 0)
+            {
+                run_worker(w);
+                exit(0);
+            }
+        }
+        for (w = 0; w < workers; w++)
+        {
+            if (threads)
+                pthread_join(tids[w], NULL);
+            else
+                wait(NULL);
+        }
+        pthread_barrier_destroy(&shared->start);
+        report(mode, workers);
+        if (workers == max_workers)
+            break;
+    }
+    close(devfd);
+    return 0;
+}
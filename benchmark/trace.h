@@ -0,0 +1,84 @@
+#ifndef NPHEAP_TRACE_H
+#define NPHEAP_TRACE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Binary trace that the benchmarks write and validate replays. Every
+// process writes npheap.<pid>.trace: a struct trace_header followed by
+// one struct trace_record per operation, in the order the process did
+// them. Records are written while the object is still locked and carry
+// a CLOCK_MONOTONIC timestamp, which is comparable across processes, so
+// merging the files by time reproduces the order each object saw.
+// Values are recorded as a hash only.
+
+#define TRACE_MAGIC   0x5254504eU  // "NPTR"
+#define TRACE_VERSION 1
+
+struct trace_header
+{
+    uint32_t magic;
+    uint32_t version;
+};
+
+struct trace_record
+{
+    uint64_t time_ns;
+    uint64_t hash;      // trace_hash() of the value, see below
+    uint32_t object;
+    uint32_t size;      // length of the value
+    uint32_t pid;
+    char op;            // 'S'et, 'G'et or 'D'elete
+    char pad[3];
+};
+
+// 64-bit FNV-1a. The empty value, which is also what a deleted or never
+// written object holds, hashes to trace_hash(NULL, 0).
+static inline uint64_t trace_hash(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline FILE *trace_open(void)
+{
+    struct trace_header header = { TRACE_MAGIC, TRACE_VERSION };
+    char filename[256];
+    FILE *fp;
+    sprintf(filename,"npheap.%d.trace",(int)getpid());
+    fp = fopen(filename,"w");
+    if (fp && fwrite(&header, sizeof(header), 1, fp) != 1)
+    {
+        fclose(fp);
+        fp = NULL;
+    }
+    return fp;
+}
+
+// Records @op on @object, whose value is now the string @value (NULL
+// for none).
+static inline void trace_write(FILE *fp, char op, int object, const char *value)
+{
+    struct trace_record rec;
+    struct timespec ts;
+    size_t len = value ? strlen(value) : 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    memset(&rec, 0, sizeof(rec));
+    rec.time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec.hash = trace_hash(value, len);
+    rec.object = object;
+    rec.size = len;
+    rec.pid = getpid();
+    rec.op = op;
+    fwrite(&rec, sizeof(rec), 1, fp);
+}
+#endif
@@ -7,77 +7,179 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
+#include "trace.h"
+
+// Replays the traces of a benchmark run and checks that every get saw
+// the latest value and that the heap ends up holding it. The traces are
+// merged by timestamp in one pass with a heap of per-file cursors, and
+// only the hash of each object's latest value is kept.
+
+struct source
+{
+    FILE *fp;
+    const char *name;
+    struct trace_record rec;
+};
+
+static struct source *sources;
+static int *heap, heap_len;
+
+static int source_before(int a, int b)
+{
+    if (sources[a].rec.time_ns != sources[b].rec.time_ns)
+        return sources[a].rec.time_ns < sources[b].rec.time_ns;
+    return a < b;
+}
+
+static void heap_down(int i)
+{
+    int child, tmp;
+    while ((child = 2 * i + 1) < heap_len)
+    {
+        if (child + 1 < heap_len && source_before(heap[child + 1], heap[child]))
+            child++;
+        if (!source_before(heap[child], heap[i]))
+            break;
+        tmp = heap[i];
+        heap[i] = heap[child];
+        heap[child] = tmp;
+        i = child;
+    }
+}
+
+// Reads the next record of source s; returns 0 at the end of its file.
+static int source_next(int s)
+{
+    if (fread(&sources[s].rec, sizeof(sources[s].rec), 1, sources[s].fp) == 1)
+        return 1;
+    if (ferror(sources[s].fp))
+        fprintf(stderr, "%s: read error\n", sources[s].name);
+    fclose(sources[s].fp);
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
-    int i=0,number_of_threads = 1, number_of_objects=1024, max_size_of_objects=8192; 
-    int tid;
+    int i=0, number_of_objects=1024, number_of_sources = 0;
     long size;
-    __u64 object_id;
-    __u64 current_time;
-    char *data,op,*mapped_data;
-    char **obj;
+    char *mapped_data;
+    uint64_t *hashes, empty = trace_hash(NULL, 0);
+    struct trace_header header;
+    struct trace_record *rec;
+    struct npheap_list_entry entries[256];
+    __u64 cursor = 0;
+    long *sizes, n;
     int devfd;
     int error = 0;
     if(argc < 2)
     {
-        fprintf(stderr, "Usage: %s number_of_objects max_size_of_objects\n",argv[0]);
+        fprintf(stderr, "Usage: %s number_of_objects npheap.<pid>.trace...\n",argv[0]);
         exit(1);
     }
     number_of_objects = atoi(argv[1]);
-    if(argc > 2)
-        max_size_of_objects = atoi(argv[2]);
-    data = (char *)malloc(max_size_of_objects*sizeof(char));
-    obj = (char **)malloc(number_of_objects*sizeof(char *));
+    hashes = (uint64_t *)malloc(number_of_objects*sizeof(uint64_t));
+    sources = (struct source *)calloc(argc, sizeof(struct source));
+    heap = (int *)calloc(argc, sizeof(int));
+    if(!hashes || !sources || !heap)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
     for(i = 0; i < number_of_objects; i++)
+        hashes[i] = empty;
+    for(i = 2; i < argc; i++)
     {
-        obj[i] = (char *)calloc(max_size_of_objects, sizeof(char));
+        struct source *src = &sources[number_of_sources];
+        src->name = argv[i];
+        src->fp = fopen(argv[i], "r");
+        if(!src->fp)
+        {
+            perror(argv[i]);
+            exit(1);
+        }
+        setvbuf(src->fp, NULL, _IOFBF, 1 << 20);
+        if(fread(&header, sizeof(header), 1, src->fp) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+        {
+            fprintf(stderr, "%s is not an npheap trace\n", argv[i]);
+            exit(1);
+        }
+        if(source_next(number_of_sources))
+            heap[heap_len++] = number_of_sources;
+        number_of_sources++;
     }
-    // Replay the log
+    for(i = heap_len / 2 - 1; i >= 0; i--)
+        heap_down(i);
+    // Replay the traces
     // Validate
-    while(scanf("%c %d %llu %llu %ld %s",&op, &tid, &current_time, &object_id, &size, &data[0])!=EOF)
+    while(heap_len > 0 && error <= 5)
     {
-        if(op == 'S')
+        rec = &sources[heap[0]].rec;
+        if(rec->object >= (uint32_t)number_of_objects)
         {
-            strcpy(obj[(int)object_id],data);
-            memset(data,0,max_size_of_objects);
-        } else if (op == 'G') {
-            if (strcmp(obj[(int)object_id], data)) {   
-                fprintf(stderr, "%d: Key %d has a wrong value %s v.s. %s\n",tid,(int)object_id,data,obj[(int)object_id]);
-                error++; 
-            }
+            fprintf(stderr, "%u: Key %u is out of range\n", rec->pid, rec->object);
+            error++;
         }
-        else if (op == 'D') {
-            memset(obj[(int)object_id],0,max_size_of_objects);
+        else if(rec->op == 'S')
+        {
+            hashes[rec->object] = rec->hash;
         }
-        if (error > 5) {
-            break;
+        else if(rec->op == 'G')
+        {
+            if(hashes[rec->object] != rec->hash)
+            {
+                fprintf(stderr, "%u: Key %u has a wrong value (hash %016llx v.s. %016llx)\n", rec->pid, rec->object,
+                        (unsigned long long)rec->hash, (unsigned long long)hashes[rec->object]);
+                error++;
+            }
         }
+        else if(rec->op == 'D')
+        {
+            hashes[rec->object] = empty;
+        }
+        if(!source_next(heap[0]))
+            heap[0] = heap[--heap_len];
+        heap_down(0);
     }
-    devfd = open("/dev/npheap",O_RDWR);
+    devfd = npheap_open(NPHEAP_BACKEND_DEFAULT);
     if(devfd < 0)
     {
         fprintf(stderr, "Device open failed");
         exit(1);
     }
+    // Enumerate the live objects instead of asking for every offset's
+    // size; offsets that are not listed are empty.
+    sizes = (long *)calloc(number_of_objects, sizeof(long));
+    while((n = npheap_list(devfd, &cursor, entries, 256)) > 0)
+    {
+        for(i = 0; i < n; i++)
+        {
+            if(entries[i].offset < (__u64)number_of_objects)
+                sizes[entries[i].offset] = entries[i].size;
+        }
+    }
+    if(n < 0)
+    {
+        fprintf(stderr, "Listing objects failed");
+        exit(1);
+    }
     for(i = 0; i < number_of_objects; i++)
     {
-        size = npheap_getsize(devfd,i);
+        size = sizes[i];
         if(size!=0)
         {
-            mapped_data = (char *)npheap_alloc(devfd,i,npheap_getsize(devfd,i));
-            if(strcmp(mapped_data,obj[i])!=0)
+            mapped_data = (char *)npheap_alloc(devfd,i,size);
+            if(trace_hash(mapped_data, strnlen(mapped_data, size)) != hashes[i])
             {
-                 fprintf(stderr, "Object %d has a wrong value %s v.s. %s\n",i,mapped_data,obj[i]);
+                 fprintf(stderr, "Object %d has a wrong value %.32s...\n",i,mapped_data);
                  error++;
             }
         }
         else
         {
             mapped_data = NULL;
-            if(strlen(obj[i])!=0)
+            if(hashes[i] != empty)
             {
-                 fprintf(stderr, "Object %d should have a value %s\n",i,obj[i]);
+                 fprintf(stderr, "Object %d should have a value\n",i);
                  error++;
             }
         }
@@ -87,4 +189,3 @@ int main(int argc, char *argv[])
     close(devfd);
     return 0;
 }
-
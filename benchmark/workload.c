@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <npheap.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// YCSB-style workload driver. After loading every object once, workers
+// issue a mix of reads (shared lock, map, scan), writes (exclusive
+// lock, map, fill), deletes and unlocked getsize calls against keys
+// drawn from one of three distributions:
+//
+//   uniform  every key equally likely
+//   zipfian  key k has weight 1/(k+1)^theta, so a few low keys are hot
+//   latest   writes insert after the newest key and reads favour the
+//            most recently inserted keys, zipfian by age
+//
+// Workers are processes, threads, or processes running threads, and run
+// either a fixed number of operations each or for a fixed time. The
+// result is one CSV line; see usage().
+
+#define OP_READ    0
+#define OP_WRITE   1
+#define OP_DELETE  2
+#define OP_GETSIZE 3
+#define NR_OPS     4
+
+#define DIST_UNIFORM 0
+#define DIST_ZIPFIAN 1
+#define DIST_LATEST  2
+
+struct worker_stats
+{
+    unsigned long long count[NR_OPS];
+    unsigned long long total_ns[NR_OPS];
+};
+
+struct shared
+{
+    pthread_barrier_t start;
+    volatile int stop;
+    unsigned long long latest;  // newest key written by a latest-mode insert
+    struct worker_stats stats[];
+};
+
+static int number_of_objects = 1024, object_size = 4096;
+static int mix[NR_OPS] = {50, 50, 0, 0};
+static int dist = DIST_ZIPFIAN;
+static double theta = 0.99;
+static int processes = 1, threads = 1;
+static long ops_per_worker = 100000;
+static int duration;
+static int devfd;
+static struct shared *shared;
+
+// Zipfian generator of Gray et al., "Quickly Generating Billion-Record
+// Synthetic Databases", as used by YCSB. zetan is O(number_of_objects)
+// to compute and is done once before the workers start.
+static double zeta2, zetan, alpha, eta;
+
+static void zipf_init(int n)
+{
+    int i;
+    zetan = 0;
+    for (i = 1; i <= n; i++)
+        zetan += 1.0 / pow(i, theta);
+    zeta2 = 1.0 + 1.0 / pow(2, theta);
+    alpha = 1.0 / (1.0 - theta);
+    eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+}
+
+// xorshift64*, one state per worker so that threads do not share rand().
+static unsigned long long next_random(unsigned long long *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double next_double(unsigned long long *state)
+{
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int next_zipf(unsigned long long *state)
+{
+    double u = next_double(state), uz = u * zetan;
+    int k;
+    if (uz < 1.0)
+        return 0;
+    if (uz < zeta2)
+        return 1;
+    k = (int)(number_of_objects * pow(eta * u - eta + 1, alpha));
+    return k < number_of_objects ? k : number_of_objects - 1;
+}
+
+static __u64 next_key(unsigned long long *state, int op)
+{
+    unsigned long long latest;
+    switch (dist)
+    {
+    case DIST_UNIFORM:
+        return next_random(state) % number_of_objects;
+    case DIST_ZIPFIAN:
+        return next_zipf(state);
+    default:
+        if (op == OP_WRITE)
+            return (__atomic_add_fetch(&shared->latest, 1, __ATOMIC_RELAXED)) % number_of_objects;
+        latest = __atomic_load_n(&shared->latest, __ATOMIC_RELAXED);
+        return (latest + number_of_objects - next_zipf(state)) % number_of_objects;
+    }
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void write_object(__u64 key, int fill)
+{
+    char *data;
+    npheap_lock(devfd, key);
+    data = npheap_alloc(devfd, key, object_size);
+    if (data == MAP_FAILED || !data)
+    {
+        fprintf(stderr, "Failed in npheap_alloc()\n");
+        exit(1);
+    }
+    memset(data, fill, object_size);
+    npheap_unlock(devfd, key);
+}
+
+static unsigned long read_object(__u64 key)
+{
+    unsigned long sum = 0;
+    unsigned char *data;
+    long size, i;
+    npheap_rdlock(devfd, key);
+    size = npheap_getsize(devfd, key);
+    if (size > 0)
+    {
+        data = npheap_alloc(devfd, key, size);
+        if (data != MAP_FAILED && data)
+            for (i = 0; i < size; i += 64)
+                sum += data[i];
+    }
+    npheap_unlock(devfd, key);
+    return sum;
+}
+
+static void run_worker(int worker)
+{
+    struct worker_stats *stats = &shared->stats[worker];
+    unsigned long long state = 0x9e3779b97f4a7c15ULL * (worker + 1) ^ now_ns();
+    unsigned long long start;
+    volatile unsigned long sink = 0;
+    long done;
+    int op, pick;
+    __u64 key;
+
+    pthread_barrier_wait(&shared->start);
+    for (done = 0; duration ? !shared->stop : done < ops_per_worker; done++)
+    {
+        pick = next_random(&state) % 100;
+        for (op = 0; pick >= mix[op]; op++)
+            pick -= mix[op];
+        key = next_key(&state, op);
+        start = now_ns();
+        switch (op)
+        {
+        case OP_READ:
+            sink += read_object(key);
+            break;
+        case OP_WRITE:
+            write_object(key, worker);
+            break;
+        case OP_DELETE:
+            npheap_lock(devfd, key);
+            npheap_delete(devfd, key);
+            npheap_unlock(devfd, key);
+            break;
+        default:
+            sink += npheap_getsize(devfd, key);
+            break;
+        }
+        stats->total_ns[op] += now_ns() - start;
+        stats->count[op]++;
+    }
+}
+
+static void *run_thread(void *arg)
+{
+    run_worker((int)(long)arg);
+    return NULL;
+}
+
+// One process of the run: starts its threads and waits for them.
+static void run_process(int process)
+{
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    int t;
+    if (!tids)
+        exit(1);
+    for (t = 0; t < threads; t++)
+        pthread_create(&tids[t], NULL, run_thread, (void *)(long)(process * threads + t));
+    for (t = 0; t < threads; t++)
+        pthread_join(tids[t], NULL);
+    free(tids);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n objects          number of objects (1024)\n"
+            "  -s size             object size in bytes (4096)\n"
+            "  -m r,w,d,g          percentages of read, write, delete, getsize (50,50,0,0)\n"
+            "  -k dist             uniform, zipfian or latest (zipfian)\n"
+            "  -z theta            zipfian skew (0.99)\n"
+            "  -p processes        worker processes (1)\n"
+            "  -t threads          threads per process (1)\n"
+            "  -o ops              operations per worker (100000)\n"
+            "  -d seconds          run for a fixed time instead of -o\n"
+            "Prints: dist,processes,threads,seconds,ops,ops_per_sec,contended,\n"
+            "        then <op>_count,<op>_avg_ns for read, write, delete, getsize\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *dist_names[] = {"uniform", "zipfian", "latest"};
+    struct npheap_stats before, after;
+    unsigned long long total = 0, count, ns;
+    unsigned long long start, elapsed;
+    int workers, w, op, opt, have_stats;
+    size_t shared_size;
+    pthread_barrierattr_t attr;
+
+    while ((opt = getopt(argc, argv, "n:s:m:k:z:p:t:o:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n': number_of_objects = atoi(optarg); break;
+        case 's': object_size = atoi(optarg); break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d,%d", &mix[0], &mix[1], &mix[2], &mix[3]) != NR_OPS)
+                usage(argv[0]);
+            break;
+        case 'k':
+            for (dist = 0; dist < 3 && strcmp(optarg, dist_names[dist]); dist++)
+                ;
+            if (dist == 3)
+                usage(argv[0]);
+            break;
+        case 'z': theta = atof(optarg); break;
+        case 'p': processes = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'o': ops_per_worker = atol(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (number_of_objects < 2 || object_size <= 0 || processes <= 0 || threads <= 0 ||
+        theta <= 0 || theta == 1.0 || mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[3] < 0 ||
+        mix[0] + mix[1] + mix[2] + mix[3] != 100)
+        usage(argv[0]);
+    workers = processes * threads;
+    zipf_init(number_of_objects);
+
+    devfd = npheap_open(NPHEAP_BACKEND_DEFAULT);
+    if(devfd < 0)
+    {
+        fprintf(stderr, "Device open failed");
+        exit(1);
+    }
+    shared_size = sizeof(*shared) + (size_t)workers * sizeof(struct worker_stats);
+    shared = mmap(0, shared_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    shared->latest = number_of_objects - 1;
+    pthread_barrierattr_init(&attr);
+    pthread_barrierattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_barrier_init(&shared->start, &attr, workers + 1);
+    pthread_barrierattr_destroy(&attr);
+
+    // Load phase
+    for (w = 0; w < number_of_objects; w++)
+        write_object(w, 0);
+    have_stats = npheap_stats(devfd, &before) == 0;
+
+    fflush(stdout);
+    for (w = 0; w < processes; w++)
+    {
+        if (fork() == 0)
+        {
+            run_process(w);
+            exit(0);
+        }
+    }
+    pthread_barrier_wait(&shared->start);
+    start = now_ns();
+    if (duration)
+    {
+        sleep(duration);
+        shared->stop = 1;
+    }
+    for (w = 0; w < processes; w++)
+        wait(NULL);
+    elapsed = now_ns() - start;
+    have_stats = have_stats && npheap_stats(devfd, &after) == 0;
+
+    for (w = 0; w < workers; w++)
+        for (op = 0; op < NR_OPS; op++)
+            total += shared->stats[w].count[op];
+    printf("%s,%d,%d,%.3f,%llu,%.0f,", dist_names[dist], processes, threads, elapsed / 1e9, total, total * 1e9 / elapsed);
+    if (have_stats)
+        printf("%llu", (unsigned long long)(after.contended - before.contended));
+    for (op = 0; op < NR_OPS; op++)
+    {
+        count = ns = 0;
+        for (w = 0; w < workers; w++)
+        {
+            count += shared->stats[w].count[op];
+            ns += shared->stats[w].total_ns[op];
+        }
+        printf(",%llu,%llu", count, count ? ns / count : 0);
+    }
+    printf("\n");
+    pthread_barrier_destroy(&shared->start);
+    close(devfd);
+    return 0;
+}
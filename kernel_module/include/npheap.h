@@ -43,9 +43,191 @@ struct npheap_cmd {
     void *data;
 };
 
+// Values of npheap_cmd.op inside an NPHEAP_IOCTL_BATCH
+#define NPHEAP_OP_LOCK     0
+#define NPHEAP_OP_UNLOCK   1
+#define NPHEAP_OP_GETSIZE  2
+#define NPHEAP_OP_DELETE   3
+#define NPHEAP_OP_RDLOCK   4
+#define NPHEAP_OP_GET      5
+#define NPHEAP_OP_PUT      6
+#define NPHEAP_OP_TRYLOCK  7
+#define NPHEAP_OP_RESIZE   8
+
+struct npheap_batch {
+    __u64 count;
+    struct npheap_cmd *cmds;
+    __s64 *results;	// one return value per command
+};
+
 #define NPHEAP_IOCTL_LOCK  _IOWR('N', 0x43, struct npheap_cmd)
 #define NPHEAP_IOCTL_UNLOCK  _IOWR('N', 0x44, struct npheap_cmd)
 #define NPHEAP_IOCTL_DELETE  _IOWR('N', 0x45, struct npheap_cmd)
 #define NPHEAP_IOCTL_GETSIZE  _IOWR('N', 0x46, struct npheap_cmd)
+#define NPHEAP_IOCTL_RDLOCK  _IOWR('N', 0x47, struct npheap_cmd)
+#define NPHEAP_IOCTL_BATCH  _IOWR('N', 0x48, struct npheap_batch)
+#define NPHEAP_IOCTL_OBJSTAT  _IOWR('N', 0x49, struct npheap_cmd)
+
+// NUMA placement of an object's pages, set through npheap_cmd.data by
+// NPHEAP_IOCTL_NUMA. It applies to pages allocated afterwards; pages
+// already backing the object stay where they are.
+#define NPHEAP_NUMA_DEFAULT     0	// the module's npheap_numa policy
+#define NPHEAP_NUMA_LOCAL       1	// node of the task that first touches the page
+#define NPHEAP_NUMA_INTERLEAVE  2	// page n on the (n mod count)th of nodes
+#define NPHEAP_NUMA_BIND        3	// the toucher's node if in nodes, else the first of nodes
+#define NPHEAP_NUMA_MAX_NODES   64
+
+struct npheap_numa {
+    __u32 policy;
+    __u32 reserved;
+    __u64 nodes;	// bit n selects node n; 0 means every node with memory
+};
+
+#define NPHEAP_IOCTL_NUMA  _IOWR('N', 0x53, struct npheap_cmd)
+
+// Filled in through npheap_cmd.data by NPHEAP_IOCTL_OBJSTAT
+struct npheap_objstat {
+    __u64 size;
+    __u64 resident;	// bytes of backing allocated so far
+    __u32 flags;
+    __u32 huge_pages;	// PMD-sized pages backing the object
+    struct npheap_numa numa;	// placement requested for the object
+    __u64 node_pages[NPHEAP_NUMA_MAX_NODES];	// resident pages on each node
+};
+
+#define NPHEAP_OBJ_HUGE  0x1	// large enough to be backed by huge pages
+#define NPHEAP_OBJ_SMALL 0x2	// value stored packed, never mapped
+#define NPHEAP_OBJ_COMPRESSED 0x4	// cold, held as an LZ4 image of resident bytes
+
+// Copy a value in or out without mapping the object: cmd.data points to
+// the buffer and cmd.size gives its length. GET returns the object's size.
+#define NPHEAP_IOCTL_GET  _IOWR('N', 0x4a, struct npheap_cmd)
+#define NPHEAP_IOCTL_PUT  _IOWR('N', 0x4b, struct npheap_cmd)
+
+// Enumerate live objects in offset order. Up to count entries with an
+// offset of at least cursor are stored in entries; cursor is advanced
+// past the last one, so repeating the call continues the scan. Returns
+// the number of entries stored, 0 once the heap is exhausted.
+struct npheap_list_entry {
+    __u64 offset;
+    __u64 size;
+};
+
+struct npheap_list {
+    __u64 cursor;
+    __u64 count;
+    struct npheap_list_entry *entries;
+};
+
+#define NPHEAP_IOCTL_LIST  _IOWR('N', 0x4c, struct npheap_list)
+
+// Exclusive lock that fails with EBUSY instead of sleeping.
+#define NPHEAP_IOCTL_TRYLOCK  _IOWR('N', 0x4f, struct npheap_cmd)
+
+// Write-lock every object in offsets[0..count-1]. The kernel takes the
+// locks in ascending offset order, so concurrent callers cannot deadlock
+// whatever order they list them in; duplicates are locked once. Gives up
+// after timeout_ms milliseconds (never if negative, immediately if 0)
+// with ETIMEDOUT (EBUSY for 0), leaving none of the objects locked.
+// Release each object with NPHEAP_IOCTL_UNLOCK.
+struct npheap_lock_many {
+    __u64 count;
+    __u64 *offsets;
+    __s32 timeout_ms;
+    __u32 reserved;
+};
+
+#define NPHEAP_LOCK_MANY_MAX  64
+#define NPHEAP_IOCTL_LOCK_MANY  _IOWR('N', 0x50, struct npheap_lock_many)
+
+// Change the object's size to cmd.size in place. Pages within both the
+// old and the new size are kept as they are, so existing mappings stay
+// valid up to the new size; mapping beyond the old size needs a new
+// mmap(). Call with the object locked.
+#define NPHEAP_IOCTL_RESIZE  _IOWR('N', 0x51, struct npheap_cmd)
+
+// Module statistics, summed over all CPUs, copied to npheap_cmd.data by
+// NPHEAP_IOCTL_STATS. latency[NPHEAP_STAT_IOCTL(cmd)] covers each ioctl;
+// the entries after them cover page faults and, for locks taken in the
+// kernel, the time spent waiting and the time the write lock was held
+// until released through the kernel. Bucket i counts latencies of
+// [2^i, 2^(i+1)) ns.
+#define NPHEAP_STAT_BUCKETS     32
+#define NPHEAP_STAT_IOCTL(cmd)  (_IOC_NR(cmd) - 0x43)
+#define NPHEAP_STAT_NR_IOCTLS   17
+#define NPHEAP_STAT_FAULT       17
+#define NPHEAP_STAT_LOCK_WAIT   18
+#define NPHEAP_STAT_LOCK_HOLD   19
+#define NPHEAP_STAT_NR          20
+
+struct npheap_latency {
+    __u64 count;
+    __u64 total_ns;
+    __u64 buckets[NPHEAP_STAT_BUCKETS];
+};
+
+struct npheap_stats {
+    struct npheap_latency latency[NPHEAP_STAT_NR];
+    __u64 contended;	// kernel lock acquisitions that had to sleep
+    __u64 resident_bytes;	// pages and packed values currently allocated
+    __u64 objects;	// extents and packed values currently allocated
+    __u64 compressed_objects;	// extents currently held compressed
+    __u64 compressed_bytes;	// size of their images, part of resident_bytes
+    __u64 uncompressed_bytes;	// resident bytes the images replaced
+    __u64 compressions;	// cold extents compressed
+    __u64 decompressions;	// compressed extents brought back on use
+};
+
+#define NPHEAP_IOCTL_STATS  _IOWR('N', 0x52, struct npheap_cmd)
+
+// Change notification. NPHEAP_IOCTL_WAIT sleeps until the object's
+// version differs from version, for at most timeout_ms milliseconds
+// (forever if negative), and stores the current version back; it fails
+// with ETIMEDOUT if nothing changed. NPHEAP_IOCTL_WATCH makes poll() on
+// this file report POLLIN once the object's version differs from
+// version; each open file watches at most one object.
+struct npheap_wait {
+    __u64 offset;
+    __u32 version;
+    __s32 timeout_ms;
+};
+
+#define NPHEAP_IOCTL_WAIT  _IOWR('N', 0x4d, struct npheap_wait)
+#define NPHEAP_IOCTL_WATCH  _IOWR('N', 0x4e, struct npheap_wait)
+
+// Shared metadata area, mapped read/write by mmap()ing the device at
+// NPHEAP_META_OFFSET. It holds the lock word of every object whose page
+// offset is below nslots, so that libnpheap can take and release
+// uncontended locks with atomics and only fall back to the lock ioctls
+// when NPHEAP_LOCK_WAITERS is set or the lock is busy. The generation
+// count lets libnpheap tell whether a mapping it cached still shows the
+// object's current backing. Object offsets must stay below
+// NPHEAP_META_OFFSET.
+#define NPHEAP_META_OFFSET  (1ULL << 44)
+#define NPHEAP_META_MAGIC   0x4e504850
+
+#define NPHEAP_LOCK_WRITER  0x80000000U    // held exclusively
+#define NPHEAP_LOCK_WAITERS 0x40000000U    // release must go through the kernel
+#define NPHEAP_LOCK_READERS 0x3fffffffU    // number of shared holders
+
+// Mapping the device at NPHEAP_WINDOW_OFFSET + first * window_stride
+// creates a window: a single mapping in which object first + i appears
+// at i * window_stride bytes, instead of one mapping per object.
+#define NPHEAP_WINDOW_OFFSET  (1ULL << 45)
+
+struct npheap_slot {
+    __u32 lock;
+    __u32 gen;		// bumped whenever the object's backing is replaced
+    __u32 version;	// bumped by every write unlock, put and delete
+    __u32 seq;		// odd while a write lock is held
+};
+
+struct npheap_meta {
+    __u32 magic;
+    __u32 nslots;
+    __u32 window_stride;	// bytes per object in a window mapping
+    __u8 reserved[52];
+    struct npheap_slot slots[];
+};
 
 #endif
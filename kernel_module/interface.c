@@ -43,10 +43,14 @@
 #include <linux/poll.h>
 #include <linux/mutex.h>
 
-extern long npheap_lock(struct npheap_cmd __user *user_cmd);
-extern long npheap_unlock(struct npheap_cmd __user *user_cmd);
 extern long npheap_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+extern __poll_t npheap_poll(struct file *filp, poll_table *pt);
+extern int npheap_open(struct inode *inode, struct file *filp);
+extern int npheap_release(struct inode *inode, struct file *filp);
 extern int npheap_mmap(struct file *filp, struct vm_area_struct *vma);
+extern unsigned long npheap_get_unmapped_area(struct file *filp, unsigned long addr,
+                                              unsigned long len, unsigned long pgoff,
+                                              unsigned long flags);
 extern int npheap_init(void);
 extern void npheap_exit(void);
 
@@ -54,6 +58,10 @@ static const struct file_operations npheap_fops = {
     .owner                = THIS_MODULE,
     .unlocked_ioctl       = npheap_ioctl,
     .mmap                 = npheap_mmap,
+    .get_unmapped_area    = npheap_get_unmapped_area,
+    .open                 = npheap_open,
+    .poll                 = npheap_poll,
+    .release              = npheap_release,
 };
 
 struct miscdevice npheap_dev = {
@@ -0,0 +1,239 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     LZ4 compression of cold objects
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/jiffies.h>
+#include <linux/workqueue.h>
+#include <linux/crypto.h>
+#include <linux/lz4.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+// An object nobody has mapped, not even through a window, and nobody
+// has used through the kernel for npheap_compress_after seconds is
+// cold. A worker scanning the index every half interval compresses each
+// cold object into one LZ4 image and frees its pages; the next mmap,
+// window fault, GET, PUT or resize puts the pages back first. Locking
+// an object does not. With no mapping left the pages can only be
+// reached through those paths, all of which hold obj->mutex, so the
+// mutex is all that guards the switch. Huge extents, objects above
+// npheap_compress_max and images saving less than a quarter are left
+// alone.
+static unsigned int npheap_compress_after = 60;
+module_param(npheap_compress_after, uint, 0444);
+MODULE_PARM_DESC(npheap_compress_after, "Compress objects unmapped and unused for this many seconds (0 disables)");
+
+static unsigned int npheap_compress_max = 1 << 20;
+module_param(npheap_compress_max, uint, 0444);
+MODULE_PARM_DESC(npheap_compress_max, "Largest object, in bytes, that is compressed");
+
+// The "lz4" transform keeps its working memory in the tfm, so one user
+// at a time.
+static struct crypto_comp *npheap_lz4;
+static DEFINE_MUTEX(npheap_lz4_lock);
+
+// Scratch space of the worker, which is the only compressor.
+static void *npheap_compress_src, *npheap_compress_dst;
+static unsigned int npheap_compress_dst_len;
+
+static void npheap_compress_scan(struct work_struct *work);
+static DECLARE_DELAYED_WORK(npheap_compress_work, npheap_compress_scan);
+
+// Forgets the image of an extent that is going away.
+void npheap_compress_free(struct npheap_extent *ext)
+{
+    if (!ext->compressed)
+        return;
+    npheap_stat_compress(0, -(long)ext->compressed_from, -(long)ext->compressed_len);
+    kvfree(ext->compressed);
+    ext->compressed = NULL;
+}
+
+// Called with obj->mutex held by everything that is about to use the
+// extent's pages: marks the extent as used and, if it is compressed,
+// decompresses it.
+int npheap_extent_use(struct npheap_extent *ext)
+{
+    unsigned int len = ext->nr_pages << PAGE_SHIFT, dlen = len;
+    unsigned long i;
+    struct page *page;
+    void *buf;
+    int ret;
+
+    WRITE_ONCE(ext->last_used, jiffies);
+    if (!ext->compressed)
+        return 0;
+    buf = kvmalloc(len, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    mutex_lock(&npheap_lz4_lock);
+    ret = crypto_comp_decompress(npheap_lz4, ext->compressed, ext->compressed_len, buf, &dlen);
+    mutex_unlock(&npheap_lz4_lock);
+    if (ret || dlen != len) {
+        ret = -EIO;
+        goto out;
+    }
+    // Pages that are all zeroes read the same untouched.
+    for (i = 0; i < ext->nr_pages; i++) {
+        if (!memchr_inv(buf + (i << PAGE_SHIFT), 0, PAGE_SIZE))
+            continue;
+        page = npheap_extent_page(ext, i);
+        if (!page) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        memcpy(page_address(page), buf + (i << PAGE_SHIFT), PAGE_SIZE);
+    }
+    npheap_stat_compress(-1, -(long)ext->compressed_from, -(long)ext->compressed_len);
+    kvfree(ext->compressed);
+    ext->compressed = NULL;
+out:
+    kvfree(buf);
+    return ret;
+}
+
+static bool npheap_extent_cold(struct npheap_extent *ext, unsigned long now)
+{
+    unsigned long last_used = READ_ONCE(ext->last_used);
+
+    return !ext->compressed && !ext->huge && ext->nr_pages &&
+           ext->nr_pages <= (npheap_compress_max >> PAGE_SHIFT) &&
+           atomic_long_read(&ext->nr_resident) && kref_read(&ext->ref) == 1 &&
+           ext->compress_tried != last_used &&
+           time_after(now, last_used + npheap_compress_after * HZ);
+}
+
+static void npheap_compress_object(struct npheap_object *obj)
+{
+    unsigned long now = jiffies, i, resident;
+    unsigned int len, clen = npheap_compress_dst_len;
+    struct npheap_extent *ext = READ_ONCE(obj->ext);
+    struct page *page;
+    void *image;
+
+    if (!ext || !npheap_extent_cold(ext, now) || !mutex_trylock(&obj->mutex))
+        return;
+    // Only the object's reference is left, and new mappings need the
+    // mutex we now hold.
+    ext = obj->ext;
+    if (!ext || !npheap_extent_cold(ext, now))
+        goto out;
+    // Window PTEs are written through without the mutex and never
+    // update last_used, so an object with a page in any window is in
+    // use. Window faults take the mutex, so none can appear now; zapping
+    // first still makes sure no store can reach the pages once they
+    // have been copied.
+    for (i = 0; i < ext->nr_pages; i++) {
+        page = ext->pages[i];
+        if (page && page_mapped(page)) {
+            WRITE_ONCE(ext->last_used, now);
+            goto out;
+        }
+    }
+    npheap_window_zap(obj);
+    len = ext->nr_pages << PAGE_SHIFT;
+    for (i = 0; i < ext->nr_pages; i++) {
+        page = ext->pages[i];
+        if (page)
+            memcpy(npheap_compress_src + (i << PAGE_SHIFT), page_address(page), PAGE_SIZE);
+        else
+            memset(npheap_compress_src + (i << PAGE_SHIFT), 0, PAGE_SIZE);
+    }
+    resident = atomic_long_read(&ext->nr_resident) << PAGE_SHIFT;
+    mutex_lock(&npheap_lz4_lock);
+    if (crypto_comp_compress(npheap_lz4, npheap_compress_src, len, npheap_compress_dst, &clen))
+        clen = UINT_MAX;
+    mutex_unlock(&npheap_lz4_lock);
+    if (clen > resident - resident / 4 ||
+        !(image = kvmalloc(clen, GFP_KERNEL))) {
+        ext->compress_tried = ext->last_used;
+        goto out;
+    }
+    memcpy(image, npheap_compress_dst, clen);
+    npheap_extent_drop_pages(ext, 0);
+    ext->compressed = image;
+    ext->compressed_len = clen;
+    ext->compressed_from = resident;
+    npheap_stat_compress(1, resident, clen);
+out:
+    mutex_unlock(&obj->mutex);
+}
+
+static void npheap_compress_scan(struct work_struct *work)
+{
+    npheap_object_for_each(npheap_compress_object);
+    queue_delayed_work(system_unbound_wq, &npheap_compress_work,
+                       max(npheap_compress_after * HZ / 2, 1U * HZ));
+}
+
+void npheap_compress_init(void)
+{
+    unsigned int max;
+
+    if (!npheap_compress_after)
+        return;
+    max = round_down(npheap_compress_max, PAGE_SIZE);
+    npheap_compress_dst_len = LZ4_COMPRESSBOUND(max);
+    npheap_lz4 = crypto_alloc_comp("lz4", 0, 0);
+    npheap_compress_src = kvmalloc(max, GFP_KERNEL);
+    npheap_compress_dst = kvmalloc(npheap_compress_dst_len, GFP_KERNEL);
+    if (IS_ERR(npheap_lz4) || !max || !npheap_compress_src || !npheap_compress_dst) {
+        printk(KERN_ERR "npheap: LZ4 unavailable, cold objects stay uncompressed\n");
+        if (!IS_ERR(npheap_lz4))
+            crypto_free_comp(npheap_lz4);
+        npheap_lz4 = NULL;
+        kvfree(npheap_compress_src);
+        kvfree(npheap_compress_dst);
+        npheap_compress_src = npheap_compress_dst = NULL;
+        return;
+    }
+    queue_delayed_work(system_unbound_wq, &npheap_compress_work, npheap_compress_after * HZ);
+}
+
+// Called once the device is gone, before the objects are freed. Images
+// still held are freed along with their extents.
+void npheap_compress_exit(void)
+{
+    if (!npheap_lz4)
+        return;
+    cancel_delayed_work_sync(&npheap_compress_work);
+    crypto_free_comp(npheap_lz4);
+    npheap_lz4 = NULL;
+    kvfree(npheap_compress_src);
+    kvfree(npheap_compress_dst);
+    npheap_compress_src = npheap_compress_dst = NULL;
+}
@@ -30,6 +30,7 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include "npheap.h"
+#include "internal.h"
 
 #include <asm/uaccess.h>
 #include <linux/slab.h>
@@ -42,26 +43,539 @@
 #include <linux/moduleparam.h>
 #include <linux/poll.h>
 #include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/log2.h>
+#include <linux/mman.h>
+#include <linux/pfn_t.h>
+#include <linux/sched.h>
+#include <linux/timekeeping.h>
 
 extern struct miscdevice npheap_dev;
 
+// Sparse index of every object, keyed by page offset. Lookups are
+// lock-free (RCU inside xa_load) and cost O(log64 n), so they stay flat
+// for millions of objects. The index is split into npheap_stripes
+// independent xarrays so that creating objects at different offsets does
+// not serialize on a single xa_lock; object N lives in stripe
+// N % npheap_stripes under key N / npheap_stripes, which keeps each
+// stripe as dense as the whole heap.
+static unsigned int npheap_stripes = 16;
+module_param(npheap_stripes, uint, 0444);
+MODULE_PARM_DESC(npheap_stripes, "Number of index stripes (rounded up to a power of two)");
+
+struct npheap_stripe {
+    struct xarray objects;
+} ____cacheline_aligned_in_smp;
+
+static struct npheap_stripe *npheap_index;
+static unsigned int npheap_stripe_shift;
+static struct kmem_cache *npheap_object_cache;
+
+// Every open file of the device shares the inode's address space, which
+// is remembered on the first mmap() so that mappings can be zapped.
+struct address_space *npheap_mapping;
+
+static inline struct xarray *npheap_stripe_of(unsigned long key, unsigned long *index)
+{
+    *index = key >> npheap_stripe_shift;
+    return &npheap_index[key & (npheap_stripes - 1)].objects;
+}
+
+struct npheap_object *npheap_object_lookup(unsigned long key)
+{
+    unsigned long index;
+    struct xarray *xa = npheap_stripe_of(key, &index);
+
+    return xa_load(xa, index);
+}
+
+// Look the object up, creating an empty one if the key is new.
+struct npheap_object *npheap_object_get(unsigned long key)
+{
+    struct npheap_object *obj, *old;
+    unsigned long index;
+    struct xarray *xa;
+
+    if (key >= NPHEAP_KEY_LIMIT)
+        return ERR_PTR(-EINVAL);
+    xa = npheap_stripe_of(key, &index);
+    obj = xa_load(xa, index);
+    if (obj)
+        return obj;
+
+    obj = kmem_cache_zalloc(npheap_object_cache, GFP_KERNEL);
+    if (!obj)
+        return ERR_PTR(-ENOMEM);
+    obj->key = key;
+    mutex_init(&obj->mutex);
+    npheap_object_init_lock(obj);
+
+    old = xa_cmpxchg(xa, index, NULL, obj, GFP_KERNEL);
+    if (old) {
+        // Lost the race against another creator, or the insert failed.
+        kmem_cache_free(npheap_object_cache, obj);
+        if (xa_is_err(old))
+            return ERR_PTR(xa_err(old));
+        return old;
+    }
+    return obj;
+}
+
+// Returns the first object at or after index *pos in a stripe that has a
+// value, advancing *pos to it.
+static struct npheap_object *npheap_stripe_next(struct xarray *xa, unsigned long *pos)
+{
+    struct npheap_object *obj;
+
+    for (obj = xa_find(xa, pos, ULONG_MAX, XA_PRESENT); obj;
+         obj = xa_find_after(xa, pos, ULONG_MAX, XA_PRESENT))
+        if (READ_ONCE(obj->size))
+            return obj;
+    return NULL;
+}
+
+// Stores up to @max live objects with keys of at least *@pos in @out, in
+// key order, and moves *@pos past the last one. Keys are interleaved
+// across the stripes, so this merges one cursor per stripe.
+int npheap_object_list(unsigned long *pos, struct npheap_list_entry *out, int max)
+{
+    struct npheap_object **next, *obj;
+    unsigned long start = *pos, index;
+    unsigned int s, best;
+    int n = 0;
+
+    if (start >= NPHEAP_KEY_LIMIT)
+        return 0;
+    next = kmalloc_array(npheap_stripes, sizeof(*next), GFP_KERNEL);
+    if (!next)
+        return -ENOMEM;
+    for (s = 0; s < npheap_stripes; s++) {
+        index = start >> npheap_stripe_shift;
+        if (((index << npheap_stripe_shift) | s) < start)
+            index++;
+        next[s] = npheap_stripe_next(&npheap_index[s].objects, &index);
+    }
+    while (n < max) {
+        best = npheap_stripes;
+        for (s = 0; s < npheap_stripes; s++)
+            if (next[s] && (best == npheap_stripes || next[s]->key < next[best]->key))
+                best = s;
+        if (best == npheap_stripes)
+            break;
+        obj = next[best];
+        out[n].offset = (__u64)obj->key << PAGE_SHIFT;
+        out[n].size = READ_ONCE(obj->size);
+        n++;
+        *pos = obj->key + 1;
+        index = (obj->key >> npheap_stripe_shift) + 1;
+        next[best] = npheap_stripe_next(&npheap_index[best].objects, &index);
+    }
+    if (n < max)
+        *pos = NPHEAP_KEY_LIMIT;
+    kfree(next);
+    return n;
+}
+
+int npheap_object_stat(struct npheap_object *obj, struct npheap_objstat *st)
+{
+    struct npheap_extent *ext;
+
+    memset(st, 0, sizeof(*st));
+    mutex_lock(&obj->mutex);
+    st->numa = obj->numa;
+    ext = obj->ext;
+    if (ext) {
+        st->size = ext->size;
+        st->resident = (__u64)atomic_long_read(&ext->nr_resident) << PAGE_SHIFT;
+        st->huge_pages = atomic_read(&ext->nr_huge);
+        if (ext->huge)
+            st->flags |= NPHEAP_OBJ_HUGE;
+        if (ext->compressed) {
+            st->resident = ext->compressed_len;
+            st->flags |= NPHEAP_OBJ_COMPRESSED;
+        }
+        npheap_numa_stat(ext, st);
+    } else if (obj->small) {
+        st->size = obj->size;
+        st->resident = obj->size;
+        st->flags |= NPHEAP_OBJ_SMALL;
+    }
+    mutex_unlock(&obj->mutex);
+    return 0;
+}
+
+// Returns the object's extent, creating one of @size bytes if it has
+// none. A packed small value moves into the first page of the new
+// extent, and a compressed extent is decompressed. Call with obj->mutex
+// held.
+struct npheap_extent *npheap_object_extent(struct npheap_object *obj, __u64 size)
+{
+    struct npheap_extent *ext = obj->ext;
+    int ret;
+
+    if (ext) {
+        if ((ret = npheap_extent_use(ext)))
+            return ERR_PTR(ret);
+        return ext;
+    }
+    ext = npheap_extent_alloc(obj, max(size, obj->size));
+    if (!ext)
+        return ERR_PTR(-ENOMEM);
+    if (obj->small) {
+        if (npheap_extent_write(ext, obj->small, obj->size)) {
+            npheap_extent_put(ext);
+            return ERR_PTR(-ENOMEM);
+        }
+        npheap_small_free(obj->small, obj->size);
+        obj->small = NULL;
+    }
+    obj->ext = ext;
+    WRITE_ONCE(obj->size, ext->size);
+    return ext;
+}
+
+// Drops the object's backing store. Mappings that already exist keep
+// their extent alive; later mmaps see an empty object. Nothing is freed
+// here: the extent's pages go to the reclaim worker once its last
+// reference is dropped, so delete takes the same time for any size.
+void npheap_object_delete(struct npheap_object *obj)
+{
+    struct npheap_extent *ext;
+
+    void *small;
+    __u64 size;
+
+    mutex_lock(&obj->mutex);
+    ext = obj->ext;
+    small = obj->small;
+    size = obj->size;
+    obj->ext = NULL;
+    obj->small = NULL;
+    WRITE_ONCE(obj->size, 0);
+    if (ext) {
+        smp_store_release(&obj->slot->gen, obj->slot->gen + 1);
+        npheap_window_zap(obj);
+    }
+    if (ext || small)
+        npheap_object_changed(obj);
+    mutex_unlock(&obj->mutex);
+    if (ext)
+        npheap_extent_put(ext);
+    if (small)
+        npheap_small_free(small, size);
+}
+
+// Grows or shrinks the object in place; see npheap_extent_resize(). An
+// object without an extent gets one of the new size, taking over a
+// packed small value. The caller is expected to hold the object's lock.
+int npheap_object_resize(struct npheap_object *obj, __u64 size)
+{
+    struct npheap_extent *ext;
+    __u64 old_size;
+    int ret = 0;
+
+    mutex_lock(&obj->mutex);
+    old_size = obj->size;
+    ext = npheap_object_extent(obj, size);
+    if (IS_ERR(ext)) {
+        ret = PTR_ERR(ext);
+        goto out;
+    }
+    if (size != ext->size && (ret = npheap_extent_resize(ext, size)))
+        goto out;
+    WRITE_ONCE(obj->size, size);
+    if (size < old_size)
+        npheap_window_zap(obj);
+    if (size != old_size)
+        npheap_object_changed(obj);
+out:
+    mutex_unlock(&obj->mutex);
+    return ret;
+}
+
+// Calls @fn on every object in the index, live or not. Objects are
+// never freed while the module is loaded, so @fn may sleep.
+void npheap_object_for_each(void (*fn)(struct npheap_object *obj))
+{
+    struct npheap_object *obj;
+    unsigned long index;
+    unsigned int i;
+
+    for (i = 0; i < npheap_stripes; i++) {
+        xa_for_each(&npheap_index[i].objects, index, obj) {
+            fn(obj);
+            cond_resched();
+        }
+    }
+}
+
+// Removes every user mapping of the given device page offsets.
+void npheap_zap_range(unsigned long pgoff, unsigned long nr_pages)
+{
+    struct address_space *mapping = READ_ONCE(npheap_mapping);
+
+    if (mapping)
+        unmap_mapping_range(mapping, (loff_t)pgoff << PAGE_SHIFT,
+                            (loff_t)nr_pages << PAGE_SHIFT, 1);
+}
+
+static void npheap_vm_open(struct vm_area_struct *vma)
+{
+    struct npheap_extent *ext = vma->vm_private_data;
+
+    kref_get(&ext->ref);
+}
+
+// An object counts as used until its last mapping goes away.
+static void npheap_vm_close(struct vm_area_struct *vma)
+{
+    struct npheap_extent *ext = vma->vm_private_data;
+
+    WRITE_ONCE(ext->last_used, jiffies);
+    npheap_extent_put(ext);
+}
+
+// Pages are allocated on first touch. vm_pgoff moves when a VMA is
+// split, so the page index is taken relative to the extent's key. The
+// page is mapped before ext->resize is dropped, so a shrinking resize
+// either sees the new entry and zaps it or has already cut the page.
+static vm_fault_t npheap_vm_fault(struct vm_fault *vmf)
+{
+    struct npheap_extent *ext = vmf->vma->vm_private_data;
+    unsigned long index = vmf->pgoff - ext->key;
+    struct page *page;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    u64 start = ktime_get_ns();
+    int err;
+
+    down_read(&ext->resize);
+    if (index >= ext->nr_pages)
+        goto out;
+    ret = VM_FAULT_OOM;
+    page = npheap_extent_page(ext, index);
+    if (!page)
+        goto out;
+    err = vm_insert_page(vmf->vma, vmf->address & PAGE_MASK, page);
+    ret = (err && err != -EBUSY) ? vmf_error(err) : VM_FAULT_NOPAGE;
+out:
+    up_read(&ext->resize);
+    npheap_stat_latency(NPHEAP_STAT_FAULT, start);
+    return ret;
+}
+
+static const struct vm_operations_struct npheap_vm_ops = {
+    .open   = npheap_vm_open,
+    .close  = npheap_vm_close,
+    .fault  = npheap_vm_fault,
+};
+
+// Shared mappings of huge extents are VM_PFNMAP so that whole chunks can
+// be mapped with one PMD. The VMA's extent reference keeps the pages
+// alive, so no per-page references are taken here. The price is that
+// get_user_pages() refuses such mappings: MAP_POPULATE quietly skips
+// them, and O_DIRECT buffers, process-shared futexes and ptrace reads in
+// them fail. Loading the module with npheap_huge=0 avoids that.
+static vm_fault_t npheap_vm_pfn_fault(struct vm_fault *vmf)
+{
+    struct npheap_extent *ext = vmf->vma->vm_private_data;
+    unsigned long index = vmf->pgoff - ext->key;
+    struct page *page;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    u64 start = ktime_get_ns();
+
+    down_read(&ext->resize);
+    if (index < ext->nr_pages) {
+        page = npheap_extent_page(ext, index);
+        ret = page ? vmf_insert_pfn(vmf->vma, vmf->address, page_to_pfn(page)) : VM_FAULT_OOM;
+    }
+    up_read(&ext->resize);
+    npheap_stat_latency(NPHEAP_STAT_FAULT, start);
+    return ret;
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static vm_fault_t npheap_vm_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    struct npheap_extent *ext = vma->vm_private_data;
+    unsigned long addr = vmf->address & HPAGE_PMD_MASK;
+    unsigned long index, i;
+    struct page *page;
+    vm_fault_t ret = VM_FAULT_FALLBACK;
+    u64 start;
+
+    if (pe_size != PE_SIZE_PMD)
+        return VM_FAULT_FALLBACK;
+    if (addr < vma->vm_start || addr + HPAGE_PMD_SIZE > vma->vm_end)
+        return VM_FAULT_FALLBACK;
+    // The chunk must start at the same offset in the VMA and the object.
+    index = vma->vm_pgoff + ((addr - vma->vm_start) >> PAGE_SHIFT) - ext->key;
+    if (index & (NPHEAP_HUGE_NR - 1))
+        return VM_FAULT_FALLBACK;
+    start = ktime_get_ns();
+    down_read(&ext->resize);
+    if (index + NPHEAP_HUGE_NR > ext->nr_pages)
+        goto out;
+    page = npheap_extent_page(ext, index);
+    if (!page) {
+        ret = VM_FAULT_OOM;
+        goto out;
+    }
+    // A chunk cut by a shrinking resize and grown again keeps the head of
+    // its compound page but has fresh 4 KiB pages where the tail was;
+    // only a chunk still made of the compound page alone is mapped whole.
+    for (i = 1; i < NPHEAP_HUGE_NR && READ_ONCE(ext->pages[index + i]) == page + i; i++)
+        ;
+    if (PageHead(page) && i == NPHEAP_HUGE_NR)
+        ret = vmf_insert_pfn_pmd(vmf, page_to_pfn_t(page), vmf->flags & FAULT_FLAG_WRITE);
+out:
+    up_read(&ext->resize);
+    if (ret != VM_FAULT_FALLBACK)
+        npheap_stat_latency(NPHEAP_STAT_FAULT, start);
+    return ret;
+}
+#endif
+
+static const struct vm_operations_struct npheap_huge_vm_ops = {
+    .open   = npheap_vm_open,
+    .close  = npheap_vm_close,
+    .fault  = npheap_vm_pfn_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    .huge_fault = npheap_vm_huge_fault,
+#endif
+};
+
+// Places mappings of huge-sized objects on a PMD boundary so that their
+// chunks line up with huge page table entries.
+unsigned long npheap_get_unmapped_area(struct file *filp, unsigned long addr,
+                                       unsigned long len, unsigned long pgoff,
+                                       unsigned long flags)
+{
+    unsigned long (*get_area)(struct file *, unsigned long, unsigned long,
+                              unsigned long, unsigned long) = current->mm->get_unmapped_area;
+    unsigned long huge_size = PAGE_SIZE << NPHEAP_HUGE_ORDER;
+    unsigned long ret;
+
+    if (!NPHEAP_HUGE_ORDER || addr || (flags & MAP_FIXED) || len < huge_size ||
+        len + huge_size < len)
+        return get_area(filp, addr, len, pgoff, flags);
+    ret = get_area(filp, 0, len + huge_size, 0, flags);
+    if (IS_ERR_VALUE(ret))
+        return get_area(filp, addr, len, pgoff, flags);
+    return ALIGN(ret, huge_size);
+}
+
+// Nothing is allocated or mapped here beyond the extent header. A
+// mapping created with MAP_POPULATE has every page faulted in before
+// mmap() returns instead, except for VM_PFNMAP mappings of huge extents,
+// which NPHEAP_ALLOC_PREFAULT in libnpheap populates by touching them.
 int npheap_mmap(struct file *filp, struct vm_area_struct *vma)
 {
+    struct npheap_object *obj;
+    struct npheap_extent *ext;
+
+    if (vma->vm_pgoff >= NPHEAP_WINDOW_PGOFF)
+        return npheap_window_mmap(filp, vma);
+    if (vma->vm_pgoff == NPHEAP_KEY_LIMIT)
+        return npheap_meta_mmap(vma);
+    obj = npheap_object_get(vma->vm_pgoff);
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+
+    mutex_lock(&obj->mutex);
+    // The first mapping of an object defines its size.
+    ext = npheap_object_extent(obj, vma->vm_end - vma->vm_start);
+    if (IS_ERR(ext)) {
+        mutex_unlock(&obj->mutex);
+        return PTR_ERR(ext);
+    }
+    kref_get(&ext->ref);
+    mutex_unlock(&obj->mutex);
+
+    WRITE_ONCE(npheap_mapping, filp->f_mapping);
+    vma->vm_private_data = ext;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+    if (ext->huge && (vma->vm_flags & VM_SHARED)) {
+        vma->vm_ops = &npheap_huge_vm_ops;
+        vma->vm_flags |= VM_PFNMAP | VM_HUGEPAGE;
+    } else {
+        vma->vm_ops = &npheap_vm_ops;
+        vma->vm_flags |= VM_MIXEDMAP;
+    }
     return 0;
 }
 
 int npheap_init(void)
 {
     int ret;
-    if ((ret = misc_register(&npheap_dev)))
+    unsigned int i;
+
+    npheap_stripes = roundup_pow_of_two(clamp(npheap_stripes, 1U, 4096U));
+    npheap_stripe_shift = ilog2(npheap_stripes);
+    npheap_index = kcalloc(npheap_stripes, sizeof(*npheap_index), GFP_KERNEL);
+    if (!npheap_index)
+        return -ENOMEM;
+    for (i = 0; i < npheap_stripes; i++)
+        xa_init(&npheap_index[i].objects);
+    if ((ret = npheap_numa_init()))
+        goto out_index;
+    ret = -ENOMEM;
+    npheap_object_cache = KMEM_CACHE(npheap_object, 0);
+    if (!npheap_object_cache)
+        goto out_index;
+    if ((ret = npheap_meta_init()))
+        goto out_cache;
+    if ((ret = npheap_small_init()))
+        goto out_meta;
+    npheap_window_init();
+    npheap_pool_init();
+    npheap_stats_init();
+    npheap_compress_init();
+    if ((ret = misc_register(&npheap_dev))) {
         printk(KERN_ERR "Unable to register \"npheap\" misc device\n");
-    else
-        printk(KERN_ERR "\"npheap\" misc device installed\n");
+        goto out_small;
+    }
+    printk(KERN_ERR "\"npheap\" misc device installed\n");
+    return 0;
+
+out_small:
+    npheap_compress_exit();
+    npheap_stats_exit();
+    npheap_pool_exit();
+    npheap_small_exit();
+out_meta:
+    npheap_meta_exit();
+out_cache:
+    kmem_cache_destroy(npheap_object_cache);
+out_index:
+    kfree(npheap_index);
     return ret;
 }
 
 void npheap_exit(void)
 {
+    struct npheap_object *obj;
+    unsigned long index;
+    unsigned int i;
+
     misc_deregister(&npheap_dev);
+    npheap_compress_exit();
+    for (i = 0; i < npheap_stripes; i++) {
+        xa_for_each(&npheap_index[i].objects, index, obj) {
+            if (obj->ext)
+                npheap_extent_put(obj->ext);
+            if (obj->small)
+                npheap_small_free(obj->small, obj->size);
+            kmem_cache_free(npheap_object_cache, obj);
+        }
+        xa_destroy(&npheap_index[i].objects);
+    }
+    kmem_cache_destroy(npheap_object_cache);
+    kfree(npheap_index);
+    npheap_extent_exit();
+    npheap_stats_exit();
+    npheap_pool_exit();
+    npheap_small_exit();
+    npheap_meta_exit();
 }
 
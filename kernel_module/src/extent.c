@@ -0,0 +1,301 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Backing store of NPHeap objects
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/slab.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/huge_mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+
+// Objects of at least NPHEAP_HUGE_NR pages are backed by PMD-sized
+// compound pages where the allocator can provide them, which lets the
+// fault path map them with a single PMD entry instead of 512 PTEs.
+static bool npheap_huge = true;
+module_param(npheap_huge, bool, 0644);
+MODULE_PARM_DESC(npheap_huge, "Back large objects with huge pages when available");
+
+// An extent only records how large the object is up front; its pages
+// are allocated by npheap_extent_page() when first touched, on the
+// nodes the object's placement asks for.
+struct npheap_extent *npheap_extent_alloc(struct npheap_object *obj, __u64 size)
+{
+    struct npheap_extent *ext;
+    unsigned long nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+
+    ext = kzalloc(sizeof(*ext), GFP_KERNEL);
+    if (!ext)
+        return NULL;
+    ext->pages = kvcalloc(max(nr_pages, 1UL), sizeof(ext->pages[0]), GFP_KERNEL);
+    if (!ext->pages) {
+        kfree(ext);
+        return NULL;
+    }
+    kref_init(&ext->ref);
+    mutex_init(&ext->lock);
+    init_rwsem(&ext->resize);
+    ext->key = obj->key;
+    ext->numa = obj->numa;
+    ext->size = size;
+    ext->nr_pages = nr_pages;
+    ext->capacity = max(nr_pages, 1UL);
+    ext->last_used = jiffies;
+    npheap_stat_objects(1);
+    ext->huge = NPHEAP_HUGE_ORDER && READ_ONCE(npheap_huge) &&
+                has_transparent_hugepage() && nr_pages >= NPHEAP_HUGE_NR;
+    return ext;
+}
+
+#define NPHEAP_RECLAIM_BATCH 64
+
+// Drops the pages in slots @from and up, handing them back to the page
+// allocator NPHEAP_RECLAIM_BATCH at a time. A huge chunk is one compound
+// page referenced from every slot of the chunk; it is only released
+// along with its head slot.
+void npheap_extent_drop_pages(struct npheap_extent *ext, unsigned long from)
+{
+    struct page *batch[NPHEAP_RECLAIM_BATCH];
+    struct page *page;
+    unsigned long i, dropped = 0;
+    int n = 0;
+
+    for (i = from; i < ext->nr_pages; i++) {
+        page = ext->pages[i];
+        if (!page)
+            continue;
+        ext->pages[i] = NULL;
+        dropped++;
+        if (PageTail(page))
+            continue;
+        if (PageHead(page))
+            atomic_dec(&ext->nr_huge);
+        batch[n++] = page;
+        if (n == NPHEAP_RECLAIM_BATCH) {
+            release_pages(batch, n);
+            n = 0;
+            cond_resched();
+        }
+    }
+    if (n)
+        release_pages(batch, n);
+    atomic_long_sub(dropped, &ext->nr_resident);
+    npheap_stat_pages(-dropped);
+}
+
+// The last reference to an extent goes away on delete or when the last
+// mapping is torn down, often with a lock held in user space. Freeing
+// the pages there would make both cost as much as the object is large,
+// so released extents are queued and freed by a worker instead.
+static LLIST_HEAD(npheap_reclaim_list);
+
+static void npheap_reclaim_fn(struct work_struct *work)
+{
+    struct llist_node *list = llist_del_all(&npheap_reclaim_list);
+    struct npheap_extent *ext, *next;
+
+    llist_for_each_entry_safe(ext, next, list, reclaim) {
+        npheap_extent_drop_pages(ext, 0);
+        npheap_compress_free(ext);
+        kvfree(ext->pages);
+        kfree(ext);
+        npheap_stat_objects(-1);
+        cond_resched();
+    }
+}
+
+static DECLARE_WORK(npheap_reclaim_work, npheap_reclaim_fn);
+
+static void npheap_extent_release(struct kref *ref)
+{
+    struct npheap_extent *ext = container_of(ref, struct npheap_extent, ref);
+
+    if (llist_add(&ext->reclaim, &npheap_reclaim_list))
+        queue_work(system_unbound_wq, &npheap_reclaim_work);
+}
+
+// Waits for every queued extent to be freed.
+void npheap_extent_exit(void)
+{
+    flush_work(&npheap_reclaim_work);
+}
+
+void npheap_extent_put(struct npheap_extent *ext)
+{
+    kref_put(&ext->ref, npheap_extent_release);
+}
+
+// Grows or shrinks the extent without moving the pages that survive:
+// growing only makes room for more page pointers, which are filled on
+// first touch as usual, and shrinking unmaps and frees the cut tail.
+// The caller serializes resizes against each other.
+int npheap_extent_resize(struct npheap_extent *ext, __u64 size)
+{
+    unsigned long nr_pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    unsigned long old_pages = ext->nr_pages;
+    struct page **pages = NULL;
+
+    // Doubling the array keeps steadily growing objects from copying
+    // their page pointers on every step.
+    if (nr_pages > ext->capacity) {
+        pages = kvcalloc(max(nr_pages, 2 * ext->capacity), sizeof(pages[0]), GFP_KERNEL);
+        if (!pages)
+            return -ENOMEM;
+    }
+
+    down_write(&ext->resize);
+    if (pages) {
+        memcpy(pages, ext->pages, old_pages * sizeof(pages[0]));
+        kvfree(ext->pages);
+        ext->pages = pages;
+        ext->capacity = max(nr_pages, 2 * ext->capacity);
+    }
+    if (nr_pages < old_pages) {
+        // PFN mappings hold no page references, so the tail must be
+        // unmapped before its pages go.
+        npheap_zap_range(ext->key + nr_pages, old_pages - nr_pages);
+        npheap_extent_drop_pages(ext, nr_pages);
+    }
+    ext->nr_pages = nr_pages;
+    ext->size = size;
+    up_write(&ext->resize);
+    return 0;
+}
+
+// Huge extents are populated a PMD-sized chunk at a time under ext->lock.
+// A chunk nobody has touched gets one compound page; if the allocator
+// cannot provide it, or the chunk is the short tail of the object, only
+// the faulting 4 KiB page is allocated.
+static struct page *npheap_extent_fill_chunk(struct npheap_extent *ext, unsigned long index)
+{
+    unsigned long first = index & ~(NPHEAP_HUGE_NR - 1);
+    unsigned long i, n = min(NPHEAP_HUGE_NR, ext->nr_pages - first);
+    int nid = npheap_numa_node(ext, index);
+    struct page *page = NULL;
+
+    mutex_lock(&ext->lock);
+    if (ext->pages[index])
+        goto out;
+    if (n == NPHEAP_HUGE_NR) {
+        for (i = 0; i < n && !ext->pages[first + i]; i++)
+            ;
+        if (i == n)
+            page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO | __GFP_COMP |
+                                    __GFP_NOWARN | __GFP_NORETRY, NPHEAP_HUGE_ORDER);
+    }
+    if (page) {
+        for (i = 0; i < n; i++)
+            smp_store_release(&ext->pages[first + i], page + i);
+        atomic_long_add(n, &ext->nr_resident);
+        npheap_stat_pages(n);
+        atomic_inc(&ext->nr_huge);
+    } else {
+        page = npheap_pool_alloc(nid);
+        if (page) {
+            smp_store_release(&ext->pages[index], page);
+            atomic_long_inc(&ext->nr_resident);
+            npheap_stat_pages(1);
+        }
+    }
+out:
+    page = ext->pages[index];
+    mutex_unlock(&ext->lock);
+    return page;
+}
+
+// Returns page @index of the extent, allocating a zeroed page if nobody
+// has touched it yet. Concurrent faults race on a cmpxchg and the loser
+// frees its page.
+struct page *npheap_extent_page(struct npheap_extent *ext, unsigned long index)
+{
+    struct page *page, *old;
+
+    page = smp_load_acquire(&ext->pages[index]);
+    if (page)
+        return page;
+    if (ext->huge)
+        return npheap_extent_fill_chunk(ext, index);
+    page = npheap_pool_alloc(npheap_numa_node(ext, index));
+    if (!page)
+        return NULL;
+    old = cmpxchg(&ext->pages[index], NULL, page);
+    if (old) {
+        __free_page(page);
+        return old;
+    }
+    atomic_long_inc(&ext->nr_resident);
+    npheap_stat_pages(1);
+    return page;
+}
+
+// Copies @len bytes from the start of the extent to @buf. Pages nobody
+// has touched read as zeroes and are not allocated.
+void npheap_extent_read(struct npheap_extent *ext, void *buf, __u64 len)
+{
+    unsigned long index, chunk;
+    struct page *page;
+
+    for (index = 0; len; index++, buf += chunk, len -= chunk) {
+        chunk = min_t(__u64, len, PAGE_SIZE);
+        page = smp_load_acquire(&ext->pages[index]);
+        if (page)
+            memcpy(buf, page_address(page), chunk);
+        else
+            memset(buf, 0, chunk);
+    }
+}
+
+// Overwrites the extent with @len bytes from @buf followed by zeroes, so
+// the object holds exactly the new value.
+int npheap_extent_write(struct npheap_extent *ext, const void *buf, __u64 len)
+{
+    unsigned long index, chunk;
+    struct page *page;
+
+    for (index = 0; index < ext->nr_pages; index++, buf += chunk, len -= chunk) {
+        chunk = min_t(__u64, len, PAGE_SIZE);
+        page = chunk ? npheap_extent_page(ext, index) : smp_load_acquire(&ext->pages[index]);
+        if (!page) {
+            if (chunk)
+                return -ENOMEM;
+            continue;
+        }
+        memcpy(page_address(page), buf, chunk);
+        if (chunk < PAGE_SIZE)
+            memset(page_address(page) + chunk, 0, PAGE_SIZE - chunk);
+    }
+    return 0;
+}
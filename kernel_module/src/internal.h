@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Declarations shared by the NPHeap source files
+//
+////////////////////////////////////////////////////////////////////////
+
+#ifndef _NPHEAP_INTERNAL_H
+#define _NPHEAP_INTERNAL_H
+
+#include <linux/types.h>
+#include <linux/mm.h>
+#include <linux/huge_mm.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/llist.h>
+#include <linux/kref.h>
+#include <linux/poll.h>
+
+#include "npheap.h"
+
+// Keys at and above this page offset are reserved for special mappings.
+#define NPHEAP_KEY_LIMIT    (NPHEAP_META_OFFSET >> PAGE_SHIFT)
+#define NPHEAP_WINDOW_PGOFF (NPHEAP_WINDOW_OFFSET >> PAGE_SHIFT)
+
+// Objects are named by the page offset user space passes in, i.e.
+// cmd.offset >> PAGE_SHIFT for ioctls and vma->vm_pgoff for mmap.
+static inline unsigned long npheap_key(__u64 offset)
+{
+    return (unsigned long)(offset >> PAGE_SHIFT);
+}
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+#define NPHEAP_HUGE_ORDER   HPAGE_PMD_ORDER
+#else
+#define NPHEAP_HUGE_ORDER   0
+#endif
+#define NPHEAP_HUGE_NR      (1UL << NPHEAP_HUGE_ORDER)
+
+// Backing store of an object. The object and every VMA mapping it hold a
+// reference; deleting the object only drops the object's, so existing
+// mappings keep the old contents until they go away. Resizing keeps the
+// extent, so every mapping sees the new size; page faults hold resize
+// for reading and npheap_extent_resize() holds it for writing, which is
+// what lets it replace the page array and drop pages.
+struct npheap_extent {
+    struct kref ref;
+    unsigned long key;      // page offset of the object
+    __u64 size;
+    unsigned long nr_pages;
+    unsigned long capacity; // length of pages[]
+    bool huge;              // populated in NPHEAP_HUGE_NR page chunks
+    struct mutex lock;      // serializes chunk population
+    struct rw_semaphore resize;
+    atomic_long_t nr_resident;
+    atomic_t nr_huge;
+    struct page **pages;    // NULL until first touched
+    struct npheap_numa numa;    // where new pages go, from the object
+    unsigned long last_used;    // jiffies of the last use through the kernel
+    unsigned long compress_tried;   // last_used when compressing did not pay
+    void *compressed;       // LZ4 image of the pages while cold, see compress.c
+    unsigned int compressed_len;
+    unsigned long compressed_from;  // resident bytes the image replaced
+    struct llist_node reclaim;
+};
+
+// One entry in the object index. Entries are created on first use and
+// are only freed when the module is unloaded, so a pointer returned by
+// npheap_object_lookup() stays valid without further reference counting.
+struct npheap_object {
+    unsigned long key;
+    __u64 size;             // readable without the mutex
+    struct mutex mutex;     // protects ext and small
+    struct npheap_extent *ext;
+    void *small;            // packed value of a small, never mapped object
+    struct npheap_numa numa;    // placement hint, inherited by new extents
+    struct npheap_slot *slot;   // in the shared metadata area, or &own_slot
+    struct npheap_slot own_slot;
+    wait_queue_head_t wait; // lock slow path sleepers
+    u64 locked_at;          // when the kernel last granted the write lock
+    u32 locked_seq;         // slot->seq at that point
+};
+
+struct npheap_object *npheap_object_lookup(unsigned long key);
+struct npheap_object *npheap_object_get(unsigned long key);
+struct npheap_extent *npheap_object_extent(struct npheap_object *obj, __u64 size);
+void npheap_object_delete(struct npheap_object *obj);
+int npheap_object_resize(struct npheap_object *obj, __u64 size);
+extern struct address_space *npheap_mapping;
+void npheap_zap_range(unsigned long pgoff, unsigned long nr_pages);
+int npheap_object_list(unsigned long *pos, struct npheap_list_entry *out, int max);
+int npheap_object_stat(struct npheap_object *obj, struct npheap_objstat *st);
+void npheap_object_for_each(void (*fn)(struct npheap_object *obj));
+
+// extent.c
+struct npheap_extent *npheap_extent_alloc(struct npheap_object *obj, __u64 size);
+void npheap_extent_put(struct npheap_extent *ext);
+void npheap_extent_drop_pages(struct npheap_extent *ext, unsigned long from);
+int npheap_extent_resize(struct npheap_extent *ext, __u64 size);
+struct page *npheap_extent_page(struct npheap_extent *ext, unsigned long index);
+void npheap_extent_read(struct npheap_extent *ext, void *buf, __u64 len);
+int npheap_extent_write(struct npheap_extent *ext, const void *buf, __u64 len);
+void npheap_extent_exit(void);
+
+// small.c
+long npheap_object_put(struct npheap_object *obj, const void __user *buf, __u64 len);
+long npheap_object_get_value(struct npheap_object *obj, void __user *buf, __u64 len);
+void npheap_small_free(void *value, __u64 len);
+int npheap_small_init(void);
+void npheap_small_exit(void);
+
+// lock.c
+void npheap_object_init_lock(struct npheap_object *obj);
+int npheap_object_wrlock(struct npheap_object *obj);
+int npheap_object_wrlock_timeout(struct npheap_object *obj, long timeout);
+int npheap_object_rdlock(struct npheap_object *obj);
+int npheap_object_unlock(struct npheap_object *obj);
+void npheap_object_changed(struct npheap_object *obj);
+int npheap_object_wait(struct npheap_object *obj, u32 *version, long timeout);
+__poll_t npheap_object_poll(struct npheap_object *obj, u32 version, struct file *filp, poll_table *pt);
+extern struct npheap_meta *npheap_meta;
+int npheap_meta_mmap(struct vm_area_struct *vma);
+int npheap_meta_init(void);
+void npheap_meta_exit(void);
+
+// compress.c
+int npheap_extent_use(struct npheap_extent *ext);
+void npheap_compress_free(struct npheap_extent *ext);
+void npheap_compress_init(void);
+void npheap_compress_exit(void);
+
+// numa.c
+int npheap_numa_node(struct npheap_extent *ext, unsigned long index);
+int npheap_numa_set(struct npheap_object *obj, const struct npheap_numa *numa);
+void npheap_numa_stat(struct npheap_extent *ext, struct npheap_objstat *st);
+int npheap_numa_init(void);
+
+// pool.c
+struct page *npheap_pool_alloc(int nid);
+void npheap_pool_init(void);
+void npheap_pool_exit(void);
+
+// stats.c
+void npheap_stat_latency(unsigned int stat, u64 start);
+void npheap_stat_contended(void);
+void npheap_stat_pages(long delta);
+void npheap_stat_small(long bytes, int objects);
+void npheap_stat_objects(int delta);
+void npheap_stat_compress(int op, long bytes, long stored);
+void npheap_stats_read(struct npheap_stats *st);
+void npheap_stats_init(void);
+void npheap_stats_exit(void);
+
+// window.c
+int npheap_window_mmap(struct file *filp, struct vm_area_struct *vma);
+void npheap_window_zap(struct npheap_object *obj);
+void npheap_window_init(void);
+
+#endif
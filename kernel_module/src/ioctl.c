@@ -30,8 +30,9 @@
 ////////////////////////////////////////////////////////////////////////
 
 #include "npheap.h"
+#include "internal.h"
 
-#include <asm/uaccess.h>
+#include <linux/uaccess.h>
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/errno.h>
@@ -42,40 +43,459 @@
 #include <linux/moduleparam.h>
 #include <linux/poll.h>
 #include <linux/mutex.h>
+#include <linux/sched/signal.h>
+#include <linux/sort.h>
+#include <linux/jiffies.h>
+#include <linux/timekeeping.h>
 
-// If exist, return the data.
-long npheap_lock(struct npheap_cmd __user *user_cmd)
+// Each object carries its own lock, so processes working on different
+// offsets never contend. Locking an offset that has no object yet creates
+// an empty one, which is how writers claim a new object before mapping it.
+long npheap_lock(struct npheap_cmd *cmd)
 {
-    return 0;
+    struct npheap_object *obj;
+
+    obj = npheap_object_get(npheap_key(cmd->offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    return npheap_object_wrlock(obj);
 }     
 
-long npheap_unlock(struct npheap_cmd __user *user_cmd)
+long npheap_trylock(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+
+    obj = npheap_object_get(npheap_key(cmd->offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    return npheap_object_wrlock_timeout(obj, 0);
+}
+
+static int npheap_cmp_key(const void *a, const void *b)
+{
+    __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Locks are taken in key order, the one global order every caller
+// agrees on, and the deadline covers the whole set.
+long npheap_lock_many(struct npheap_lock_many __user *user_req)
+{
+    struct npheap_lock_many req;
+    struct npheap_object *objs[NPHEAP_LOCK_MANY_MAX];
+    __u64 keys[NPHEAP_LOCK_MANY_MAX];
+    unsigned long deadline;
+    long timeout;
+    int i, n = 0, locked = 0, ret = 0;
+
+    if (copy_from_user(&req, user_req, sizeof(req)))
+        return -EFAULT;
+    if (req.count > NPHEAP_LOCK_MANY_MAX)
+        return -E2BIG;
+    if (copy_from_user(keys, req.offsets, req.count * sizeof(keys[0])))
+        return -EFAULT;
+    for (i = 0; i < req.count; i++)
+        keys[i] = npheap_key(keys[i]);
+    sort(keys, req.count, sizeof(keys[0]), npheap_cmp_key, NULL);
+    for (i = 0; i < req.count; i++) {
+        if (n && keys[i] == keys[n - 1])
+            continue;
+        keys[n] = keys[i];
+        objs[n] = npheap_object_get(keys[n]);
+        if (IS_ERR(objs[n]))
+            return PTR_ERR(objs[n]);
+        n++;
+    }
+
+    timeout = req.timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(req.timeout_ms);
+    deadline = jiffies + timeout;
+    for (locked = 0; locked < n; locked++) {
+        if (req.timeout_ms > 0)
+            timeout = max_t(long, (long)(deadline - jiffies), 1);
+        if ((ret = npheap_object_wrlock_timeout(objs[locked], timeout)))
+            break;
+    }
+    if (ret)
+        while (locked--)
+            npheap_object_unlock(objs[locked]);
+    return ret;
+}
+
+// Shared lock: any number of readers may hold an object at once, while
+// NPHEAP_IOCTL_LOCK still waits for all of them to leave.
+long npheap_rdlock(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+
+    obj = npheap_object_get(npheap_key(cmd->offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    return npheap_object_rdlock(obj);
+}
+
+// Releases whichever kind of lock the caller holds.
+long npheap_unlock(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+
+    // The lock may have been taken in user space without ever creating
+    // the object, so look it up the same way the lock path does.
+    obj = npheap_object_get(npheap_key(cmd->offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    return npheap_object_unlock(obj);
+}
+
+long npheap_getsize(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+
+    obj = npheap_object_lookup(npheap_key(cmd->offset));
+    return obj ? (long)obj->size : 0;
+}
+long npheap_delete(struct npheap_cmd *cmd)
 {
+    struct npheap_object *obj;
+
+    obj = npheap_object_lookup(npheap_key(cmd->offset));
+    if (obj)
+        npheap_object_delete(obj);
     return 0;
 }
 
-long npheap_getsize(struct npheap_cmd __user *user_cmd)
+long npheap_objstat(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+    struct npheap_objstat *st;
+    long ret = 0;
+
+    st = kmalloc(sizeof(*st), GFP_KERNEL);
+    if (!st)
+        return -ENOMEM;
+    obj = npheap_object_lookup(npheap_key(cmd->offset));
+    if (obj)
+        npheap_object_stat(obj, st);
+    else
+        memset(st, 0, sizeof(*st));
+    if (copy_to_user((void __user *) cmd->data, st, sizeof(*st)))
+        ret = -EFAULT;
+    kfree(st);
+    return ret;
+}
+
+// Sets where the object's pages are allocated from now on; see struct
+// npheap_numa. Creates the object if needed, so the placement can be
+// chosen before anything is mapped.
+long npheap_numa(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+    struct npheap_numa numa;
+
+    if (copy_from_user(&numa, (void __user *) cmd->data, sizeof(numa)))
+        return -EFAULT;
+    obj = npheap_object_get(npheap_key(cmd->offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    return npheap_numa_set(obj, &numa);
+}
+
+long npheap_get(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+
+    obj = npheap_object_lookup(npheap_key(cmd->offset));
+    if (!obj)
+        return 0;
+    return npheap_object_get_value(obj, (void __user *) cmd->data, cmd->size);
+}
+
+long npheap_put(struct npheap_cmd *cmd)
+{
+    struct npheap_object *obj;
+
+    obj = npheap_object_get(npheap_key(cmd->offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    return npheap_object_put(obj, (const void __user *) cmd->data, cmd->size);
+}
+
+long npheap_resize(struct npheap_cmd *cmd)
 {
+    struct npheap_object *obj;
+
+    obj = npheap_object_get(npheap_key(cmd->offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    return npheap_object_resize(obj, cmd->size);
+}
+
+static long npheap_do_op(__u64 op, struct npheap_cmd *cmd)
+{
+    switch (op) {
+    case NPHEAP_OP_LOCK:
+        return npheap_lock(cmd);
+    case NPHEAP_OP_UNLOCK:
+        return npheap_unlock(cmd);
+    case NPHEAP_OP_GETSIZE:
+        return npheap_getsize(cmd);
+    case NPHEAP_OP_DELETE:
+        return npheap_delete(cmd);
+    case NPHEAP_OP_RDLOCK:
+        return npheap_rdlock(cmd);
+    case NPHEAP_OP_GET:
+        return npheap_get(cmd);
+    case NPHEAP_OP_PUT:
+        return npheap_put(cmd);
+    case NPHEAP_OP_TRYLOCK:
+        return npheap_trylock(cmd);
+    case NPHEAP_OP_RESIZE:
+        return npheap_resize(cmd);
+    default:
+        return -EINVAL;
+    }
+}
+
+#define NPHEAP_BATCH_CHUNK 16
+
+// Runs every command of the batch in order and stores each command's
+// return value in the matching results[] slot. Commands are copied in
+// and results out a chunk at a time. A failing command does not stop
+// the batch; the ioctl itself returns the number of commands executed.
+long npheap_batch(struct npheap_batch __user *user_batch)
+{
+    struct npheap_batch batch;
+    struct npheap_cmd cmds[NPHEAP_BATCH_CHUNK];
+    __s64 results[NPHEAP_BATCH_CHUNK];
+    __u64 done, i, n;
+
+    if (copy_from_user(&batch, user_batch, sizeof(batch)))
+        return -EFAULT;
+    for (done = 0; done < batch.count; done += n) {
+        n = min_t(__u64, batch.count - done, NPHEAP_BATCH_CHUNK);
+        if (copy_from_user(cmds, batch.cmds + done, n * sizeof(cmds[0])))
+            return -EFAULT;
+        for (i = 0; i < n; i++)
+            results[i] = npheap_do_op(cmds[i].op, &cmds[i]);
+        if (copy_to_user(batch.results + done, results, n * sizeof(results[0])))
+            return -EFAULT;
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+    }
+    return done;
+}
+
+#define NPHEAP_LIST_CHUNK 32
+
+long npheap_list(struct npheap_list __user *user_list)
+{
+    struct npheap_list list;
+    struct npheap_list_entry entries[NPHEAP_LIST_CHUNK];
+    unsigned long pos;
+    __u64 done;
+    int n;
+
+    if (copy_from_user(&list, user_list, sizeof(list)))
+        return -EFAULT;
+    if (list.cursor >= NPHEAP_META_OFFSET)
+        return 0;
+    pos = npheap_key(list.cursor + PAGE_SIZE - 1);
+    for (done = 0; done < list.count; done += n) {
+        n = npheap_object_list(&pos, entries, min_t(__u64, list.count - done, NPHEAP_LIST_CHUNK));
+        if (n < 0)
+            return n;
+        if (copy_to_user(list.entries + done, entries, n * sizeof(entries[0])))
+            return -EFAULT;
+        if (!n)
+            break;
+        cond_resched();
+    }
+    list.cursor = (__u64)pos << PAGE_SHIFT;
+    if (put_user(list.cursor, &user_list->cursor))
+        return -EFAULT;
+    return done;
+}
+
+long npheap_wait(struct npheap_wait __user *user_wait)
+{
+    struct npheap_wait wait;
+    struct npheap_object *obj;
+    u32 version;
+    long timeout;
+    int ret;
+
+    if (copy_from_user(&wait, user_wait, sizeof(wait)))
+        return -EFAULT;
+    // Waiting on an object that does not exist yet is allowed, so that
+    // a consumer can start before its producer.
+    obj = npheap_object_get(npheap_key(wait.offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    timeout = wait.timeout_ms < 0 ? MAX_SCHEDULE_TIMEOUT : msecs_to_jiffies(wait.timeout_ms);
+    version = wait.version;
+    ret = npheap_object_wait(obj, &version, timeout);
+    if (ret == -ETIMEDOUT)
+        version = READ_ONCE(obj->slot->version);
+    if (put_user(version, &user_wait->version))
+        return -EFAULT;
+    return ret;
+}
+
+// What poll() on an open file reports on, set by NPHEAP_IOCTL_WATCH.
+struct npheap_watch {
+    spinlock_t lock;
+    struct npheap_object *obj;
+    u32 version;
+};
+
+long npheap_watch(struct file *filp, struct npheap_wait __user *user_wait)
+{
+    struct npheap_watch *watch = READ_ONCE(filp->private_data), *new;
+    struct npheap_wait wait;
+    struct npheap_object *obj;
+
+    if (copy_from_user(&wait, user_wait, sizeof(wait)))
+        return -EFAULT;
+    obj = npheap_object_get(npheap_key(wait.offset));
+    if (IS_ERR(obj))
+        return PTR_ERR(obj);
+    if (!watch) {
+        new = kzalloc(sizeof(*new), GFP_KERNEL);
+        if (!new)
+            return -ENOMEM;
+        spin_lock_init(&new->lock);
+        watch = cmpxchg(&filp->private_data, NULL, new);
+        if (watch)
+            kfree(new);
+        else
+            watch = new;
+    }
+    spin_lock(&watch->lock);
+    watch->obj = obj;
+    watch->version = wait.version;
+    spin_unlock(&watch->lock);
+    return 0;
+}
+
+__poll_t npheap_poll(struct file *filp, poll_table *pt)
+{
+    struct npheap_watch *watch = READ_ONCE(filp->private_data);
+    struct npheap_object *obj;
+    u32 version;
+
+    if (!watch)
+        return 0;
+    spin_lock(&watch->lock);
+    obj = watch->obj;
+    version = watch->version;
+    spin_unlock(&watch->lock);
+    return npheap_object_poll(obj, version, filp, pt);
+}
+
+// misc_open() leaves the miscdevice in private_data; we keep the watch
+// there instead.
+int npheap_open(struct inode *inode, struct file *filp)
+{
+    filp->private_data = NULL;
     return 0;
 }
-long npheap_delete(struct npheap_cmd __user *user_cmd)
+
+int npheap_release(struct inode *inode, struct file *filp)
 {
+    kfree(filp->private_data);
     return 0;
 }
 
-long npheap_ioctl(struct file *filp, unsigned int cmd,
-                                unsigned long arg)
+long npheap_stats(struct npheap_cmd *cmd)
 {
+    struct npheap_stats *st;
+    long ret = 0;
+
+    st = kmalloc(sizeof(*st), GFP_KERNEL);
+    if (!st)
+        return -ENOMEM;
+    npheap_stats_read(st);
+    if (copy_to_user((void __user *) cmd->data, st, sizeof(*st)))
+        ret = -EFAULT;
+    kfree(st);
+    return ret;
+}
+
+static long npheap_do_ioctl(struct file *filp, unsigned int cmd,
+                            unsigned long arg)
+{
+    struct npheap_cmd npcmd;
+    __u64 op;
+
     switch (cmd) {
     case NPHEAP_IOCTL_LOCK:
-        return npheap_lock((void __user *) arg);
+        op = NPHEAP_OP_LOCK;
+        break;
+    case NPHEAP_IOCTL_RDLOCK:
+        op = NPHEAP_OP_RDLOCK;
+        break;
     case NPHEAP_IOCTL_UNLOCK:
-        return npheap_unlock((void __user *) arg);
+        op = NPHEAP_OP_UNLOCK;
+        break;
     case NPHEAP_IOCTL_GETSIZE:
-        return npheap_getsize((void __user *) arg);
+        op = NPHEAP_OP_GETSIZE;
+        break;
     case NPHEAP_IOCTL_DELETE:
-        return npheap_delete((void __user *) arg);
+        op = NPHEAP_OP_DELETE;
+        break;
+    case NPHEAP_IOCTL_GET:
+        op = NPHEAP_OP_GET;
+        break;
+    case NPHEAP_IOCTL_PUT:
+        op = NPHEAP_OP_PUT;
+        break;
+    case NPHEAP_IOCTL_TRYLOCK:
+        op = NPHEAP_OP_TRYLOCK;
+        break;
+    case NPHEAP_IOCTL_RESIZE:
+        op = NPHEAP_OP_RESIZE;
+        break;
+    case NPHEAP_IOCTL_LOCK_MANY:
+        return npheap_lock_many((void __user *) arg);
+    case NPHEAP_IOCTL_BATCH:
+        return npheap_batch((void __user *) arg);
+    case NPHEAP_IOCTL_OBJSTAT:
+        if (copy_from_user(&npcmd, (void __user *) arg, sizeof(npcmd)))
+            return -EFAULT;
+        return npheap_objstat(&npcmd);
+    case NPHEAP_IOCTL_STATS:
+        if (copy_from_user(&npcmd, (void __user *) arg, sizeof(npcmd)))
+            return -EFAULT;
+        return npheap_stats(&npcmd);
+    case NPHEAP_IOCTL_NUMA:
+        if (copy_from_user(&npcmd, (void __user *) arg, sizeof(npcmd)))
+            return -EFAULT;
+        return npheap_numa(&npcmd);
+    case NPHEAP_IOCTL_LIST:
+        return npheap_list((void __user *) arg);
+    case NPHEAP_IOCTL_WAIT:
+        return npheap_wait((void __user *) arg);
+    case NPHEAP_IOCTL_WATCH:
+        return npheap_watch(filp, (void __user *) arg);
     default:
         return -ENOTTY;
     }
+    if (copy_from_user(&npcmd, (void __user *) arg, sizeof(npcmd)))
+        return -EFAULT;
+    return npheap_do_op(op, &npcmd);
+}
+
+// Every ioctl is timed into its own latency histogram.
+long npheap_ioctl(struct file *filp, unsigned int cmd,
+                                unsigned long arg)
+{
+    unsigned int stat = NPHEAP_STAT_IOCTL(cmd);
+    u64 start = ktime_get_ns();
+    long ret;
+
+    ret = npheap_do_ioctl(filp, cmd, arg);
+    if (_IOC_TYPE(cmd) == 'N' && stat < NPHEAP_STAT_NR_IOCTLS)
+        npheap_stat_latency(stat, start);
+    return ret;
 }
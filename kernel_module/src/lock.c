@@ -0,0 +1,288 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Object lock words and the shared metadata area that exposes them
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/slab.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/timekeeping.h>
+
+// Locks are 32-bit words laid out as described in npheap.h. User space
+// acquires and releases them with compare-and-swap while nobody waits;
+// the functions below are the slow path behind the lock ioctls. A task
+// that has to sleep sets NPHEAP_LOCK_WAITERS first, which forces the
+// holder's release through npheap_object_unlock() and its wake-up. The
+// lock prefers readers: a shared lock is granted whenever no writer
+// holds the word.
+//
+// Change notification rides on the same mechanism: a task waiting for a
+// new version sets NPHEAP_LOCK_WAITERS even on a free word, so that the
+// next release of the object comes through here and wakes it. Whoever
+// releases a write lock, in user space or here, bumps the version first.
+//
+// The slot's seq count is odd exactly while a writer holds the lock, so
+// that readers can copy an object without locking and retry if seq
+// moved. Whoever takes or releases a write lock bumps it.
+
+static unsigned int npheap_meta_slots = 1 << 18;
+module_param(npheap_meta_slots, uint, 0444);
+MODULE_PARM_DESC(npheap_meta_slots, "Objects whose lock word is shared with user space");
+
+struct npheap_meta *npheap_meta;
+static size_t npheap_meta_size;
+
+void npheap_object_init_lock(struct npheap_object *obj)
+{
+    if (obj->key < npheap_meta_slots)
+        obj->slot = &npheap_meta->slots[obj->key];
+    else
+        obj->slot = &obj->own_slot;
+    init_waitqueue_head(&obj->wait);
+}
+
+// Sleep until the word no longer reads @seen, which the releasing side
+// guarantees by clearing NPHEAP_LOCK_WAITERS before waking us, or until
+// *@timeout jiffies pass; *@timeout is left holding what remains. A zero
+// timeout means try-lock and fails with -EBUSY. *@wait_start records
+// when the caller first had to wait, for the statistics.
+static int npheap_lock_wait(struct npheap_object *obj, u32 seen, long *timeout, u64 *wait_start)
+{
+    u32 *word = &obj->slot->lock;
+    long ret;
+
+    if (!*timeout)
+        return -EBUSY;
+    if (!*wait_start) {
+        *wait_start = ktime_get_ns();
+        npheap_stat_contended();
+    }
+    if (!(seen & NPHEAP_LOCK_WAITERS)) {
+        if (cmpxchg(word, seen, seen | NPHEAP_LOCK_WAITERS) != seen)
+            return 0;
+        seen |= NPHEAP_LOCK_WAITERS;
+    }
+    ret = wait_event_killable_timeout(obj->wait, READ_ONCE(*word) != seen, *timeout);
+    if (ret < 0)
+        return ret;
+    if (!ret)
+        return -ETIMEDOUT;
+    *timeout = ret;
+    return 0;
+}
+
+int npheap_object_wrlock(struct npheap_object *obj)
+{
+    return npheap_object_wrlock_timeout(obj, MAX_SCHEDULE_TIMEOUT);
+}
+
+int npheap_object_wrlock_timeout(struct npheap_object *obj, long timeout)
+{
+    u32 *word = &obj->slot->lock;
+    u64 wait_start = 0;
+    u32 old;
+    int ret;
+
+    for (;;) {
+        old = READ_ONCE(*word);
+        if (!(old & ~NPHEAP_LOCK_WAITERS)) {
+            if (cmpxchg(word, old, old | NPHEAP_LOCK_WRITER) == old) {
+                WRITE_ONCE(obj->slot->seq, obj->slot->seq + 1);
+                smp_wmb();
+                if (wait_start)
+                    npheap_stat_latency(NPHEAP_STAT_LOCK_WAIT, wait_start);
+                obj->locked_at = ktime_get_ns();
+                obj->locked_seq = obj->slot->seq;
+                return 0;
+            }
+            continue;
+        }
+        if ((ret = npheap_lock_wait(obj, old, &timeout, &wait_start)))
+            return ret;
+    }
+}
+
+int npheap_object_rdlock(struct npheap_object *obj)
+{
+    u32 *word = &obj->slot->lock;
+    long timeout = MAX_SCHEDULE_TIMEOUT;
+    u64 wait_start = 0;
+    u32 old;
+    int ret;
+
+    for (;;) {
+        old = READ_ONCE(*word);
+        if (!(old & NPHEAP_LOCK_WRITER)) {
+            if ((old & NPHEAP_LOCK_READERS) == NPHEAP_LOCK_READERS)
+                return -EAGAIN;
+            if (cmpxchg(word, old, old + 1) == old) {
+                if (wait_start)
+                    npheap_stat_latency(NPHEAP_STAT_LOCK_WAIT, wait_start);
+                return 0;
+            }
+            continue;
+        }
+        if ((ret = npheap_lock_wait(obj, old, &timeout, &wait_start)))
+            return ret;
+    }
+}
+
+// Versions also change outside the lock (put, delete) and from user
+// space, so every bump is atomic.
+static void npheap_version_bump(struct npheap_object *obj)
+{
+    u32 *version = &obj->slot->version;
+    u32 old;
+
+    do {
+        old = READ_ONCE(*version);
+    } while (cmpxchg(version, old, old + 1) != old);
+}
+
+int npheap_object_unlock(struct npheap_object *obj)
+{
+    u32 *word = &obj->slot->lock;
+    u32 old, new;
+
+    if (READ_ONCE(*word) & NPHEAP_LOCK_WRITER) {
+        // Hold time is only known if this is the acquisition the kernel
+        // granted, not a later one taken in user space.
+        if (obj->locked_at && obj->slot->seq == obj->locked_seq)
+            npheap_stat_latency(NPHEAP_STAT_LOCK_HOLD, obj->locked_at);
+        obj->locked_at = 0;
+        smp_store_release(&obj->slot->seq, obj->slot->seq + 1);
+        npheap_version_bump(obj);
+    }
+    do {
+        old = READ_ONCE(*word);
+        if (old & NPHEAP_LOCK_WRITER)
+            new = 0;
+        else if (old & NPHEAP_LOCK_READERS)
+            new = (old - 1) & ~NPHEAP_LOCK_WAITERS;
+        else
+            return -EINVAL;
+    } while (cmpxchg(word, old, new) != old);
+
+    // Every sleeper re-arms NPHEAP_LOCK_WAITERS if it still cannot get in.
+    if (old & NPHEAP_LOCK_WAITERS)
+        wake_up_all(&obj->wait);
+    return 0;
+}
+
+// Bumps the version of an object changed outside the lock and wakes
+// anyone waiting for it.
+void npheap_object_changed(struct npheap_object *obj)
+{
+    npheap_version_bump(obj);
+    wake_up_all(&obj->wait);
+}
+
+// Reports whether the version already differs from @version and, if it
+// does not, makes sure the next release of the lock wakes obj->wait.
+// Arming pushes every lock and unlock of the object into the kernel until
+// a release clears it, so the version is compared first.
+static bool npheap_version_arm(struct npheap_object *obj, u32 version)
+{
+    u32 *word = &obj->slot->lock;
+    u32 old;
+
+    if (READ_ONCE(obj->slot->version) != version)
+        return true;
+    do {
+        old = READ_ONCE(*word);
+        if (old & NPHEAP_LOCK_WAITERS)
+            break;
+    } while (cmpxchg(word, old, old | NPHEAP_LOCK_WAITERS) != old);
+    smp_mb();
+    return READ_ONCE(obj->slot->version) != version;
+}
+
+static bool npheap_version_woken(struct npheap_object *obj, u32 version)
+{
+    return READ_ONCE(obj->slot->version) != version ||
+           !(READ_ONCE(obj->slot->lock) & NPHEAP_LOCK_WAITERS);
+}
+
+// Sleeps until the version differs from *@version or @timeout jiffies
+// pass, and stores the current version in *@version. A zero @timeout
+// only compares, without arming.
+int npheap_object_wait(struct npheap_object *obj, u32 *version, long timeout)
+{
+    long ret;
+
+    while (READ_ONCE(obj->slot->version) == *version) {
+        if (!timeout)
+            return -ETIMEDOUT;
+        if (npheap_version_arm(obj, *version))
+            break;
+        ret = wait_event_killable_timeout(obj->wait, npheap_version_woken(obj, *version), timeout);
+        if (ret < 0)
+            return ret;
+        timeout = ret > 1 ? ret : 0;
+    }
+    *version = READ_ONCE(obj->slot->version);
+    return 0;
+}
+
+__poll_t npheap_object_poll(struct npheap_object *obj, u32 version, struct file *filp, poll_table *pt)
+{
+    poll_wait(filp, &obj->wait, pt);
+    return npheap_version_arm(obj, version) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+int npheap_meta_mmap(struct vm_area_struct *vma)
+{
+    if (vma->vm_end - vma->vm_start > npheap_meta_size)
+        return -EINVAL;
+    return remap_vmalloc_range(vma, npheap_meta, 0);
+}
+
+int npheap_meta_init(void)
+{
+    npheap_meta_slots = min_t(unsigned long, npheap_meta_slots, NPHEAP_KEY_LIMIT);
+    npheap_meta_size = PAGE_ALIGN(struct_size(npheap_meta, slots, npheap_meta_slots));
+    npheap_meta = vmalloc_user(npheap_meta_size);
+    if (!npheap_meta)
+        return -ENOMEM;
+    npheap_meta->magic = NPHEAP_META_MAGIC;
+    npheap_meta->nslots = npheap_meta_slots;
+    return 0;
+}
+
+void npheap_meta_exit(void)
+{
+    vfree(npheap_meta);
+}
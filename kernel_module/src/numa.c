@@ -0,0 +1,163 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     NUMA placement of object pages
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+// Every page of an object is placed when it is first allocated, by the
+// object's policy or, for NPHEAP_NUMA_DEFAULT, the module's. Node sets
+// are masks of the first NPHEAP_NUMA_MAX_NODES nodes; nodes without
+// memory are ignored, and a set with none left means every node.
+static char *npheap_numa = "local";
+module_param(npheap_numa, charp, 0444);
+MODULE_PARM_DESC(npheap_numa, "Default placement of object pages: local, interleave or bind");
+
+static char *npheap_numa_nodes = "";
+module_param(npheap_numa_nodes, charp, 0444);
+MODULE_PARM_DESC(npheap_numa_nodes, "Node list for interleave and bind, e.g. 0-1 (default: all nodes with memory)");
+
+static struct npheap_numa npheap_numa_default = { .policy = NPHEAP_NUMA_LOCAL };
+static u64 npheap_numa_memory;  // nodes that have memory
+
+// Returns the @n-th node set in @nodes.
+static int npheap_numa_nth(u64 nodes, unsigned int n)
+{
+    while (n--)
+        nodes &= nodes - 1;
+    return __ffs64(nodes);
+}
+
+// Node to allocate page @index of @ext on. Huge extents are placed a
+// chunk at a time, so interleaving goes by chunk.
+int npheap_numa_node(struct npheap_extent *ext, unsigned long index)
+{
+    u32 policy = READ_ONCE(ext->numa.policy);
+    u64 nodes = READ_ONCE(ext->numa.nodes);
+    int nid = numa_mem_id();
+
+    if (policy == NPHEAP_NUMA_DEFAULT) {
+        policy = npheap_numa_default.policy;
+        nodes = npheap_numa_default.nodes;
+    }
+    nodes &= npheap_numa_memory;
+    if (!nodes)
+        nodes = npheap_numa_memory;
+    if (!nodes)
+        return NUMA_NO_NODE;
+    switch (policy) {
+    case NPHEAP_NUMA_INTERLEAVE:
+        if (ext->huge)
+            index >>= NPHEAP_HUGE_ORDER;
+        return npheap_numa_nth(nodes, index % hweight64(nodes));
+    case NPHEAP_NUMA_BIND:
+        if (nid < NPHEAP_NUMA_MAX_NODES && (nodes & BIT_ULL(nid)))
+            return nid;
+        return __ffs64(nodes);
+    default:
+        return nid;
+    }
+}
+
+// Sets the placement of pages @obj allocates from now on.
+int npheap_numa_set(struct npheap_object *obj, const struct npheap_numa *numa)
+{
+    if (numa->policy > NPHEAP_NUMA_BIND || numa->reserved)
+        return -EINVAL;
+    if (numa->nodes && !(numa->nodes & npheap_numa_memory))
+        return -EINVAL;
+    mutex_lock(&obj->mutex);
+    obj->numa = *numa;
+    if (obj->ext) {
+        WRITE_ONCE(obj->ext->numa.nodes, numa->nodes);
+        WRITE_ONCE(obj->ext->numa.policy, numa->policy);
+    }
+    mutex_unlock(&obj->mutex);
+    return 0;
+}
+
+// Counts the extent's resident pages by node.
+void npheap_numa_stat(struct npheap_extent *ext, struct npheap_objstat *st)
+{
+    struct page *page;
+    unsigned long i;
+    int nid;
+
+    down_read(&ext->resize);
+    for (i = 0; i < ext->nr_pages; i++) {
+        page = smp_load_acquire(&ext->pages[i]);
+        if (!page)
+            continue;
+        nid = page_to_nid(page);
+        if (nid < NPHEAP_NUMA_MAX_NODES)
+            st->node_pages[nid]++;
+    }
+    up_read(&ext->resize);
+}
+
+int npheap_numa_init(void)
+{
+    nodemask_t nodes;
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY) {
+        if (nid < NPHEAP_NUMA_MAX_NODES)
+            npheap_numa_memory |= BIT_ULL(nid);
+    }
+    if (!strcmp(npheap_numa, "local"))
+        npheap_numa_default.policy = NPHEAP_NUMA_LOCAL;
+    else if (!strcmp(npheap_numa, "interleave"))
+        npheap_numa_default.policy = NPHEAP_NUMA_INTERLEAVE;
+    else if (!strcmp(npheap_numa, "bind"))
+        npheap_numa_default.policy = NPHEAP_NUMA_BIND;
+    else {
+        printk(KERN_ERR "npheap: unknown npheap_numa policy %s\n", npheap_numa);
+        return -EINVAL;
+    }
+    if (*npheap_numa_nodes) {
+        if (nodelist_parse(npheap_numa_nodes, nodes)) {
+            printk(KERN_ERR "npheap: bad npheap_numa_nodes %s\n", npheap_numa_nodes);
+            return -EINVAL;
+        }
+        for_each_node_mask(nid, nodes) {
+            if (nid < NPHEAP_NUMA_MAX_NODES)
+                npheap_numa_default.nodes |= BIT_ULL(nid);
+        }
+    }
+    return 0;
+}
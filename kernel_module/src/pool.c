@@ -0,0 +1,168 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Pool of pre-zeroed pages for first-touch allocations
+//
+////////////////////////////////////////////////////////////////////////
+
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+// Zeroing a page on first touch sits on the fault path of every new
+// object. The pool keeps zeroed pages ready instead: faults take one
+// when they can, and a worker tops the pool back up to
+// npheap_pool_high pages whenever it drops below npheap_pool_low.
+// When the pool runs dry, faults allocate inline as before. Pages are
+// pooled per NUMA node, so that taking one from the pool puts it on the
+// node the object's placement asked for.
+static unsigned int npheap_pool_size = 4096;
+module_param(npheap_pool_size, uint, 0444);
+MODULE_PARM_DESC(npheap_pool_size, "Most pre-zeroed pages kept in the pool of each node (0 disables it)");
+
+static unsigned int npheap_pool_low = 1024;
+module_param(npheap_pool_low, uint, 0644);
+MODULE_PARM_DESC(npheap_pool_low, "Refill a node's page pool when it holds fewer pages than this");
+
+static unsigned int npheap_pool_high = 3072;
+module_param(npheap_pool_high, uint, 0644);
+MODULE_PARM_DESC(npheap_pool_high, "Number of pages each node's page pool is refilled to");
+
+struct npheap_pool {
+    struct list_head pages;
+    spinlock_t lock;
+    unsigned int count;
+};
+
+static struct npheap_pool npheap_pools[MAX_NUMNODES];
+static bool npheap_pool_stopping;
+
+static void npheap_pool_refill(struct work_struct *work);
+static DECLARE_WORK(npheap_pool_work, npheap_pool_refill);
+
+#define NPHEAP_POOL_BATCH 32
+
+// Pages are zeroed outside the lock and added a batch at a time.
+static void npheap_pool_refill_node(int nid, unsigned int target)
+{
+    struct npheap_pool *pool = &npheap_pools[nid];
+    struct page *page;
+    LIST_HEAD(batch);
+    int n;
+
+    while (!READ_ONCE(npheap_pool_stopping) && READ_ONCE(pool->count) < target) {
+        for (n = 0; n < NPHEAP_POOL_BATCH; n++) {
+            page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO | __GFP_THISNODE |
+                                    __GFP_NOWARN | __GFP_NORETRY, 0);
+            if (!page)
+                break;
+            list_add(&page->lru, &batch);
+        }
+        spin_lock(&pool->lock);
+        list_splice_init(&batch, &pool->pages);
+        pool->count += n;
+        spin_unlock(&pool->lock);
+        if (n < NPHEAP_POOL_BATCH)
+            break;
+        cond_resched();
+    }
+}
+
+static void npheap_pool_refill(struct work_struct *work)
+{
+    unsigned int target = min(READ_ONCE(npheap_pool_high), npheap_pool_size);
+    int nid;
+
+    for_each_node_state(nid, N_MEMORY)
+        npheap_pool_refill_node(nid, target);
+}
+
+// Returns a zeroed page on node @nid (NUMA_NO_NODE for the local one),
+// from the pool if it has one.
+struct page *npheap_pool_alloc(int nid)
+{
+    struct npheap_pool *pool;
+    struct page *page = NULL;
+    unsigned int left = 0;
+
+    if (nid == NUMA_NO_NODE)
+        nid = numa_mem_id();
+    pool = &npheap_pools[nid];
+    if (READ_ONCE(pool->count)) {
+        spin_lock(&pool->lock);
+        page = list_first_entry_or_null(&pool->pages, struct page, lru);
+        if (page) {
+            list_del(&page->lru);
+            left = --pool->count;
+        }
+        spin_unlock(&pool->lock);
+    }
+    if (npheap_pool_size && left < READ_ONCE(npheap_pool_low))
+        queue_work(system_unbound_wq, &npheap_pool_work);
+    if (!page)
+        page = alloc_pages_node(nid, GFP_KERNEL | __GFP_ZERO, 0);
+    return page;
+}
+
+void npheap_pool_init(void)
+{
+    int nid;
+
+    for (nid = 0; nid < MAX_NUMNODES; nid++) {
+        INIT_LIST_HEAD(&npheap_pools[nid].pages);
+        spin_lock_init(&npheap_pools[nid].lock);
+    }
+    npheap_pool_high = min(npheap_pool_high, npheap_pool_size);
+    npheap_pool_low = min(npheap_pool_low, npheap_pool_high);
+    if (npheap_pool_size)
+        queue_work(system_unbound_wq, &npheap_pool_work);
+}
+
+void npheap_pool_exit(void)
+{
+    struct page *page, *next;
+    int nid;
+
+    WRITE_ONCE(npheap_pool_stopping, true);
+    cancel_work_sync(&npheap_pool_work);
+    for (nid = 0; nid < MAX_NUMNODES; nid++) {
+        list_for_each_entry_safe(page, next, &npheap_pools[nid].pages, lru) {
+            list_del(&page->lru);
+            __free_page(page);
+        }
+        npheap_pools[nid].count = 0;
+    }
+}
@@ -0,0 +1,195 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Copy-based GET/PUT access and packed storage for small objects
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>
+
+// Values written with NPHEAP_IOCTL_PUT that are no larger than
+// npheap_small_max never get an extent. They are packed into slab caches
+// of power-of-two size classes, so a 30-byte value costs 32 bytes instead
+// of a page. Mapping such an object moves its value into a fresh extent.
+#define NPHEAP_SMALL_MIN_SHIFT  4
+#define NPHEAP_SMALL_CLASSES    8   // 16 bytes .. 2 KiB
+
+static unsigned int npheap_small_max = 16 << (NPHEAP_SMALL_CLASSES - 1);
+module_param(npheap_small_max, uint, 0444);
+MODULE_PARM_DESC(npheap_small_max, "Largest PUT value stored packed instead of in pages");
+
+static struct kmem_cache *npheap_small_cache[NPHEAP_SMALL_CLASSES];
+
+static struct kmem_cache *npheap_small_class(__u64 len)
+{
+    unsigned int shift = len <= 1 ? 0 : ilog2(len - 1) + 1;
+
+    return npheap_small_cache[max_t(unsigned int, shift, NPHEAP_SMALL_MIN_SHIFT) - NPHEAP_SMALL_MIN_SHIFT];
+}
+
+void npheap_small_free(void *value, __u64 len)
+{
+    kmem_cache_free(npheap_small_class(len), value);
+    npheap_stat_small(-(long)len, -1);
+}
+
+// Replaces the object's value with @len bytes from @buf. An object that
+// already has an extent (because it has been mapped) is overwritten in
+// place, so existing mappings see the new value, and must be at least
+// @len bytes long. @buf may lie in a window, whose faults take
+// obj->mutex, so user memory is only touched with the mutex dropped:
+// the value is copied in first, into its packed slot or a bounce buffer.
+long npheap_object_put(struct npheap_object *obj, const void __user *buf, __u64 len)
+{
+    struct npheap_extent *ext;
+    void *value = NULL, *bounce = NULL, *old = NULL;
+    __u64 old_len = 0;
+    long ret = 0;
+
+    if (len && len <= npheap_small_max) {
+        value = kmem_cache_alloc(npheap_small_class(len), GFP_KERNEL);
+        if (!value)
+            return -ENOMEM;
+        npheap_stat_small(len, 1);
+        if (copy_from_user(value, buf, len)) {
+            npheap_small_free(value, len);
+            return -EFAULT;
+        }
+    } else if (len) {
+        bounce = kvmalloc(len, GFP_KERNEL | __GFP_NOWARN);
+        if (!bounce)
+            return -ENOMEM;
+        if (copy_from_user(bounce, buf, len)) {
+            kvfree(bounce);
+            return -EFAULT;
+        }
+    }
+
+    mutex_lock(&obj->mutex);
+    ext = obj->ext;
+    if (ext) {
+        if (len > ext->size)
+            ret = -EFBIG;
+        else if (!(ret = npheap_extent_use(ext)))
+            ret = npheap_extent_write(ext, value ? value : bounce, len);
+    } else if (value || !len) {
+        old = obj->small;
+        old_len = obj->size;
+        obj->small = value;
+        value = NULL;
+        WRITE_ONCE(obj->size, len);
+    } else {
+        ext = npheap_extent_alloc(obj, len);
+        if (!ext)
+            ret = -ENOMEM;
+        else if ((ret = npheap_extent_write(ext, bounce, len)))
+            npheap_extent_put(ext);
+        else {
+            old = obj->small;
+            old_len = obj->size;
+            obj->small = NULL;
+            obj->ext = ext;
+            WRITE_ONCE(obj->size, len);
+        }
+    }
+    if (!ret)
+        npheap_object_changed(obj);
+    mutex_unlock(&obj->mutex);
+
+    if (value)
+        npheap_small_free(value, len);
+    kvfree(bounce);
+    if (old)
+        npheap_small_free(old, old_len);
+    return ret;
+}
+
+// Copies up to @len bytes of the object's value to @buf and returns the
+// full size of the object, so a short buffer can be detected. As with
+// PUT, the value goes through a bounce buffer and reaches @buf only once
+// obj->mutex is dropped.
+long npheap_object_get_value(struct npheap_object *obj, void __user *buf, __u64 len)
+{
+    void *bounce = NULL;
+    long ret;
+    int err;
+
+    mutex_lock(&obj->mutex);
+    ret = obj->size;
+    len = min(len, obj->size);
+    if (len) {
+        bounce = kvmalloc(len, GFP_KERNEL | __GFP_NOWARN);
+        if (!bounce)
+            ret = -ENOMEM;
+        else if (obj->small)
+            memcpy(bounce, obj->small, len);
+        else if ((err = npheap_extent_use(obj->ext)))
+            ret = err;
+        else
+            npheap_extent_read(obj->ext, bounce, len);
+    }
+    mutex_unlock(&obj->mutex);
+
+    if (ret >= 0 && len && copy_to_user(buf, bounce, len))
+        ret = -EFAULT;
+    kvfree(bounce);
+    return ret;
+}
+
+int npheap_small_init(void)
+{
+    char name[32];
+    int i;
+
+    npheap_small_max = min(npheap_small_max, 16U << (NPHEAP_SMALL_CLASSES - 1));
+    for (i = 0; i < NPHEAP_SMALL_CLASSES; i++) {
+        snprintf(name, sizeof(name), "npheap_small_%u", 16U << i);
+        npheap_small_cache[i] = kmem_cache_create(name, 16U << i, 0, 0, NULL);
+        if (!npheap_small_cache[i]) {
+            while (i--)
+                kmem_cache_destroy(npheap_small_cache[i]);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+void npheap_small_exit(void)
+{
+    int i;
+
+    for (i = 0; i < NPHEAP_SMALL_CLASSES; i++)
+        kmem_cache_destroy(npheap_small_cache[i]);
+}
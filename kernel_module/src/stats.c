@@ -0,0 +1,241 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Per-CPU statistics and latency histograms, exported via debugfs
+//
+////////////////////////////////////////////////////////////////////////
+
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+// Everything is counted per CPU, so recording never touches a cache
+// line shared with another CPU; readers sum over all CPUs. The gauges
+// (resident pages, packed bytes, objects, compressed images) are kept as
+// per-CPU deltas and only their sum is meaningful.
+struct npheap_cpu_stats {
+    struct npheap_latency latency[NPHEAP_STAT_NR];
+    u64 contended;
+    u64 compressions;
+    u64 decompressions;
+    s64 pages;
+    s64 small_bytes;
+    s64 objects;
+    s64 compressed_objects;
+    s64 compressed_bytes;
+    s64 uncompressed_bytes;
+};
+
+static DEFINE_PER_CPU(struct npheap_cpu_stats, npheap_cpu_stats);
+static struct dentry *npheap_debugfs;
+
+static const char *const npheap_stat_names[NPHEAP_STAT_NR] = {
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_LOCK)]      = "lock",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_UNLOCK)]    = "unlock",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_DELETE)]    = "delete",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_GETSIZE)]   = "getsize",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_RDLOCK)]    = "rdlock",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_BATCH)]     = "batch",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_OBJSTAT)]   = "objstat",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_GET)]       = "get",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_PUT)]       = "put",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_LIST)]      = "list",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_WAIT)]      = "wait",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_WATCH)]     = "watch",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_TRYLOCK)]   = "trylock",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_LOCK_MANY)] = "lock_many",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_RESIZE)]    = "resize",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_STATS)]     = "stats",
+    [NPHEAP_STAT_IOCTL(NPHEAP_IOCTL_NUMA)]      = "numa",
+    [NPHEAP_STAT_FAULT]                         = "fault",
+    [NPHEAP_STAT_LOCK_WAIT]                     = "lock_wait",
+    [NPHEAP_STAT_LOCK_HOLD]                     = "lock_hold",
+};
+
+void npheap_stat_latency(unsigned int stat, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    struct npheap_cpu_stats *s = get_cpu_ptr(&npheap_cpu_stats);
+    struct npheap_latency *l = &s->latency[stat];
+
+    l->count++;
+    l->total_ns += ns;
+    l->buckets[ns ? min_t(unsigned int, ilog2(ns), NPHEAP_STAT_BUCKETS - 1) : 0]++;
+    put_cpu_ptr(&npheap_cpu_stats);
+}
+
+void npheap_stat_contended(void)
+{
+    this_cpu_inc(npheap_cpu_stats.contended);
+}
+
+void npheap_stat_pages(long delta)
+{
+    this_cpu_add(npheap_cpu_stats.pages, delta);
+}
+
+void npheap_stat_small(long bytes, int objects)
+{
+    this_cpu_add(npheap_cpu_stats.small_bytes, bytes);
+    this_cpu_add(npheap_cpu_stats.objects, objects);
+}
+
+void npheap_stat_objects(int delta)
+{
+    this_cpu_add(npheap_cpu_stats.objects, delta);
+}
+
+// Records an image of @stored bytes replacing @bytes resident bytes, or
+// going away when both are negative. @op counts a compression when
+// positive and a decompression when negative; an image freed with its
+// extent is neither.
+void npheap_stat_compress(int op, long bytes, long stored)
+{
+    struct npheap_cpu_stats *s = get_cpu_ptr(&npheap_cpu_stats);
+
+    if (op > 0)
+        s->compressions++;
+    else if (op < 0)
+        s->decompressions++;
+    s->compressed_objects += stored > 0 ? 1 : -1;
+    s->compressed_bytes += stored;
+    s->uncompressed_bytes += bytes;
+    put_cpu_ptr(&npheap_cpu_stats);
+}
+
+void npheap_stats_read(struct npheap_stats *st)
+{
+    struct npheap_cpu_stats *s;
+    s64 pages = 0, small_bytes = 0, objects = 0;
+    s64 compressed_objects = 0, compressed_bytes = 0, uncompressed_bytes = 0;
+    int cpu, i, b;
+
+    memset(st, 0, sizeof(*st));
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(&npheap_cpu_stats, cpu);
+        for (i = 0; i < NPHEAP_STAT_NR; i++) {
+            st->latency[i].count += READ_ONCE(s->latency[i].count);
+            st->latency[i].total_ns += READ_ONCE(s->latency[i].total_ns);
+            for (b = 0; b < NPHEAP_STAT_BUCKETS; b++)
+                st->latency[i].buckets[b] += READ_ONCE(s->latency[i].buckets[b]);
+        }
+        st->contended += READ_ONCE(s->contended);
+        st->compressions += READ_ONCE(s->compressions);
+        st->decompressions += READ_ONCE(s->decompressions);
+        pages += READ_ONCE(s->pages);
+        small_bytes += READ_ONCE(s->small_bytes);
+        objects += READ_ONCE(s->objects);
+        compressed_objects += READ_ONCE(s->compressed_objects);
+        compressed_bytes += READ_ONCE(s->compressed_bytes);
+        uncompressed_bytes += READ_ONCE(s->uncompressed_bytes);
+    }
+    st->compressed_objects = max_t(s64, compressed_objects, 0);
+    st->compressed_bytes = max_t(s64, compressed_bytes, 0);
+    st->uncompressed_bytes = max_t(s64, uncompressed_bytes, 0);
+    st->resident_bytes = max_t(s64, pages, 0) * PAGE_SIZE + max_t(s64, small_bytes, 0) +
+                         st->compressed_bytes;
+    st->objects = max_t(s64, objects, 0);
+}
+
+// Clears the counters and histograms; the gauges keep their values.
+static void npheap_stats_reset(void)
+{
+    struct npheap_cpu_stats *s;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(&npheap_cpu_stats, cpu);
+        memset(s->latency, 0, sizeof(s->latency));
+        WRITE_ONCE(s->contended, 0);
+        WRITE_ONCE(s->compressions, 0);
+        WRITE_ONCE(s->decompressions, 0);
+    }
+}
+
+static int npheap_stats_show(struct seq_file *m, void *v)
+{
+    struct npheap_stats *st;
+    struct npheap_latency *l;
+    int i, b;
+
+    st = kmalloc(sizeof(*st), GFP_KERNEL);
+    if (!st)
+        return -ENOMEM;
+    npheap_stats_read(st);
+    seq_printf(m, "resident_bytes %llu\nobjects %llu\ncontended %llu\n",
+               st->resident_bytes, st->objects, st->contended);
+    seq_printf(m, "compressed_objects %llu\ncompressed_bytes %llu\nuncompressed_bytes %llu\n"
+               "compressions %llu\ndecompressions %llu\n",
+               st->compressed_objects, st->compressed_bytes, st->uncompressed_bytes,
+               st->compressions, st->decompressions);
+    for (i = 0; i < NPHEAP_STAT_NR; i++) {
+        l = &st->latency[i];
+        if (!npheap_stat_names[i] || !l->count)
+            continue;
+        seq_printf(m, "%s count %llu avg_ns %llu log2_ns", npheap_stat_names[i],
+                   l->count, div64_u64(l->total_ns, l->count));
+        for (b = 0; b < NPHEAP_STAT_BUCKETS; b++)
+            seq_printf(m, " %llu", l->buckets[b]);
+        seq_putc(m, '\n');
+    }
+    kfree(st);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(npheap_stats);
+
+static ssize_t npheap_reset_write(struct file *file, const char __user *buf,
+                                  size_t count, loff_t *ppos)
+{
+    npheap_stats_reset();
+    return count;
+}
+
+static const struct file_operations npheap_reset_fops = {
+    .owner  = THIS_MODULE,
+    .write  = npheap_reset_write,
+    .llseek = noop_llseek,
+};
+
+// /sys/kernel/debug/npheap/stats reads the counters; writing anything
+// to /sys/kernel/debug/npheap/reset clears them.
+void npheap_stats_init(void)
+{
+    npheap_debugfs = debugfs_create_dir("npheap", NULL);
+    debugfs_create_file("stats", 0444, npheap_debugfs, NULL, &npheap_stats_fops);
+    debugfs_create_file("reset", 0200, npheap_debugfs, NULL, &npheap_reset_fops);
+}
+
+void npheap_stats_exit(void)
+{
+    debugfs_remove_recursive(npheap_debugfs);
+}
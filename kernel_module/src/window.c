@@ -0,0 +1,111 @@
+//////////////////////////////////////////////////////////////////////
+//                             North Carolina State University
+//
+//
+//
+//                             Copyright 2016
+//
+////////////////////////////////////////////////////////////////////////
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms and conditions of the GNU General Public License,
+// version 2, as published by the Free Software Foundation.
+//
+// This program is distributed in the hope it will be useful, but WITHOUT
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+// FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+// more details.
+//
+// You should have received a copy of the GNU General Public License along with
+// this program; if not, write to the Free Software Foundation, Inc.,
+// 51 Franklin St - Fifth Floor, Boston, MA 02110-1301 USA.
+//
+////////////////////////////////////////////////////////////////////////
+//
+//   Description:
+//     Whole-heap windows: one mapping covering a range of objects
+//
+////////////////////////////////////////////////////////////////////////
+
+#include "npheap.h"
+#include "internal.h"
+
+#include <linux/kernel.h>
+#include <linux/errno.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/timekeeping.h>
+
+// A window is a single VMA in which object N appears at
+// (N - first) * stride bytes from the start, where first is the object
+// the window was mapped at. Faults look the object up and insert its
+// page, so a process needs one VMA however many objects it touches.
+// Objects larger than the stride are truncated in the window.
+static unsigned int npheap_window_stride = 64 << 10;
+module_param(npheap_window_stride, uint, 0444);
+MODULE_PARM_DESC(npheap_window_stride, "Bytes reserved per object in a window mapping");
+
+static unsigned long npheap_window_pages;
+
+static vm_fault_t npheap_window_fault(struct vm_fault *vmf)
+{
+    unsigned long rel = vmf->pgoff - NPHEAP_WINDOW_PGOFF;
+    unsigned long index = rel % npheap_window_pages;
+    struct npheap_object *obj;
+    struct npheap_extent *ext;
+    struct page *page;
+    vm_fault_t ret = VM_FAULT_SIGBUS;
+    u64 start = ktime_get_ns();
+    int err;
+
+    obj = npheap_object_lookup(rel / npheap_window_pages);
+    if (!obj)
+        return VM_FAULT_SIGBUS;
+    // Inserting under the object mutex orders us against delete, which
+    // zaps the object's window range under the same mutex.
+    mutex_lock(&obj->mutex);
+    // npheap_object_extent() also brings a compressed object back.
+    ext = obj->ext || obj->small ? npheap_object_extent(obj, obj->size) : NULL;
+    if (IS_ERR_OR_NULL(ext) || index >= ext->nr_pages)
+        goto out;
+    ret = VM_FAULT_OOM;
+    page = npheap_extent_page(ext, index);
+    if (!page)
+        goto out;
+    err = vm_insert_page(vmf->vma, vmf->address & PAGE_MASK, page);
+    ret = (err && err != -EBUSY) ? vmf_error(err) : VM_FAULT_NOPAGE;
+out:
+    mutex_unlock(&obj->mutex);
+    npheap_stat_latency(NPHEAP_STAT_FAULT, start);
+    return ret;
+}
+
+static const struct vm_operations_struct npheap_window_vm_ops = {
+    .fault  = npheap_window_fault,
+};
+
+int npheap_window_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    WRITE_ONCE(npheap_mapping, filp->f_mapping);
+    vma->vm_ops = &npheap_window_vm_ops;
+    vma->vm_flags |= VM_MIXEDMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    return 0;
+}
+
+// Removes the object's pages from every window. Call with obj->mutex
+// held after changing the object's backing.
+void npheap_window_zap(struct npheap_object *obj)
+{
+    npheap_zap_range(NPHEAP_WINDOW_PGOFF + obj->key * npheap_window_pages, npheap_window_pages);
+}
+
+void npheap_window_init(void)
+{
+    npheap_window_stride = max_t(unsigned int, PAGE_ALIGN(npheap_window_stride), PAGE_SIZE);
+    npheap_window_pages = npheap_window_stride >> PAGE_SHIFT;
+    npheap_meta->window_stride = npheap_window_stride;
+}
@@ -1,41 +1,897 @@
 #include "npheap.h"
+#include "npheap_shm.h"
 #include <npheap/npheap.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
-void *npheap_alloc(int devfd, __u64 offset, __u64 size)
+#define NPHEAP_BATCH_MAX 256
+
+// Opens the heap. NPHEAP_BACKEND_DEFAULT picks the shared-memory backend
+// when $NPHEAP_BACKEND is "shm" and /dev/npheap otherwise. Every other
+// call in this library works on the returned descriptor either way. The
+// shared-memory backend is opened once per process: opening it again
+// returns the same descriptor.
+int npheap_open(int backend)
+{
+     const char *env = getenv("NPHEAP_BACKEND");
+     if (backend == NPHEAP_BACKEND_DEFAULT)
+          backend = env && !strcmp(env, "shm") ? NPHEAP_BACKEND_SHM : NPHEAP_BACKEND_DEVICE;
+     if (backend == NPHEAP_BACKEND_SHM)
+          return npheap_shm_open();
+     return open("/dev/npheap",O_RDWR);
+}
+
+// The shared metadata area holding the object lock words is mapped once
+// per process on first use. NULL means not tried yet, MAP_FAILED means
+// the module does not provide one and every lock goes through ioctl().
+static struct npheap_meta *npheap_meta;
+
+static struct npheap_meta *npheap_meta_map(int devfd)
+{
+     struct npheap_meta *meta = __atomic_load_n(&npheap_meta, __ATOMIC_ACQUIRE);
+     struct npheap_meta *expected = NULL;
+     size_t size;
+     if (meta)
+          return meta;
+     meta = mmap(0,getpagesize(),PROT_READ,MAP_SHARED,devfd,NPHEAP_META_OFFSET);
+     if (meta != MAP_FAILED)
+     {
+          if (meta->magic == NPHEAP_META_MAGIC)
+          {
+               size = sizeof(*meta) + meta->nslots*sizeof(struct npheap_slot);
+               size = ((size + getpagesize() - 1) / getpagesize())*getpagesize();
+               munmap(meta,getpagesize());
+               meta = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,devfd,NPHEAP_META_OFFSET);
+          }
+          else
+          {
+               munmap(meta,getpagesize());
+               meta = MAP_FAILED;
+          }
+     }
+     if (!__atomic_compare_exchange_n(&npheap_meta, &expected, meta, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+     {
+          // Another thread got there first; use its mapping.
+          if (meta != MAP_FAILED)
+               munmap(meta, size);
+          meta = expected;
+     }
+     return meta;
+}
+
+static struct npheap_slot *npheap_slot(int devfd, __u64 offset)
+{
+     struct npheap_meta *meta = npheap_meta_map(devfd);
+     if (meta == MAP_FAILED || offset >= meta->nslots)
+          return NULL;
+     return &meta->slots[offset];
+}
+
+static __u32 *npheap_lockword(int devfd, __u64 offset)
+{
+     struct npheap_slot *slot = npheap_slot(devfd, offset);
+     return slot ? &slot->lock : NULL;
+}
+
+static __u32 *npheap_gen(int devfd, __u64 offset)
+{
+     struct npheap_slot *slot;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_gen(devfd, offset);
+     slot = npheap_slot(devfd, offset);
+     return slot ? &slot->gen : NULL;
+}
+
+static __u32 *npheap_seq(int devfd, __u64 offset)
+{
+     struct npheap_slot *slot;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_seq(devfd, offset);
+     slot = npheap_slot(devfd, offset);
+     return slot ? &slot->seq : NULL;
+}
+
+
+// Per-process cache of object mappings, so that mapping the same object
+// again returns the existing address instead of creating another VMA.
+// Entries are keyed by descriptor and object, so the device and the
+// shared-memory backend can be open side by side. They are validated
+// against the object's generation count in the metadata area, which the
+// module bumps when the object is deleted, so a mapping of a deleted
+// object is never handed out again; objects past the metadata area are
+// not cached. Lookups take no lock: each entry is guarded by its own
+// sequence count, and entries are never freed, only emptied, so readers
+// can always walk the hash chains. Changes to the cache are serialized by
+// npheap_cache_lock.
+//
+// A mapping that has been handed out may still be in use, so one that a
+// larger mapping replaces is not unmapped but retired: it stays on the
+// entry's list until npheap_release() or npheap_delete(), or until
+// NPHEAP_CACHE_RETIRED newer ones push it out. A mapping of an older
+// generation shows an object that has been deleted since; replacing it
+// unmaps it along with everything retired, so addresses handed out for
+// an older generation become invalid. Either way the number of VMAs a
+// process keeps per object stays bounded.
+#define NPHEAP_CACHE_BUCKETS (1 << 16)
+#define NPHEAP_CACHE_RETIRED 8
+
+struct npheap_retired {
+     struct npheap_retired *next;
+     void *addr;
+     size_t len;
+};
+
+struct npheap_mapping {
+     struct npheap_mapping *next;
+     int devfd;
+     __u64 offset;
+     unsigned seq;
+     __u32 gen;
+     void *addr;
+     size_t len;
+     struct npheap_retired *retired;
+};
+
+static struct npheap_mapping *npheap_cache[NPHEAP_CACHE_BUCKETS];
+static pthread_mutex_t npheap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct npheap_mapping **npheap_cache_bucket(int devfd, __u64 offset)
+{
+     return &npheap_cache[((offset ^ ((__u64)devfd << 40)) * 0x9e3779b97f4a7c15ULL) >> 48];
+}
+
+static struct npheap_mapping *npheap_cache_find(int devfd, __u64 offset)
+{
+     struct npheap_mapping *m = __atomic_load_n(npheap_cache_bucket(devfd, offset), __ATOMIC_ACQUIRE);
+     while (m && (m->offset != offset || m->devfd != devfd))
+          m = __atomic_load_n(&m->next, __ATOMIC_ACQUIRE);
+     return m;
+}
+
+// Returns the cached mapping if it still shows generation gen and is at
+// least len bytes long.
+static void *npheap_cache_lookup(int devfd, __u64 offset, __u32 gen, size_t len)
+{
+     struct npheap_mapping *m = npheap_cache_find(devfd, offset);
+     unsigned seq;
+     void *addr;
+     int ok;
+     if (!m)
+          return NULL;
+     do
+     {
+          seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+          addr = m->addr;
+          ok = addr && m->gen == gen && m->len >= len;
+          __atomic_thread_fence(__ATOMIC_ACQUIRE);
+     } while ((seq & 1) || seq != __atomic_load_n(&m->seq, __ATOMIC_RELAXED));
+     return ok ? addr : NULL;
+}
+
+static void npheap_retired_unmap(struct npheap_retired *r)
+{
+     struct npheap_retired *next;
+     for (; r; r = next)
+     {
+          next = r->next;
+          munmap(r->addr, r->len);
+          free(r);
+     }
+}
+
+// Call with npheap_cache_lock held. The mapping addr replaces the cached
+// one, which is retired or, if it is of another generation, unmapped.
+// Returns -1 if memory runs out, leaving the cache as it was.
+static int npheap_cache_set(int devfd, __u64 offset, __u32 gen, void *addr, size_t len)
+{
+     struct npheap_mapping **bucket = npheap_cache_bucket(devfd, offset);
+     struct npheap_mapping *m = npheap_cache_find(devfd, offset);
+     struct npheap_retired *r, *stale = NULL, **p;
+     void *stale_addr = NULL;
+     size_t stale_len = 0;
+     int n;
+     if (!m)
+     {
+          if (!(m = calloc(1, sizeof(*m))))
+               return -1;
+          m->devfd = devfd;
+          m->offset = offset;
+          m->next = *bucket;
+          __atomic_store_n(bucket, m, __ATOMIC_RELEASE);
+     }
+     if (m->addr && m->gen != gen)
+     {
+          stale_addr = m->addr;
+          stale_len = m->len;
+          stale = m->retired;
+          m->retired = NULL;
+     }
+     else if (m->addr)
+     {
+          if (!(r = malloc(sizeof(*r))))
+               return -1;
+          r->addr = m->addr;
+          r->len = m->len;
+          r->next = m->retired;
+          m->retired = r;
+          for (n = 0, p = &m->retired; *p && n < NPHEAP_CACHE_RETIRED; n++)
+               p = &(*p)->next;
+          stale = *p;
+          *p = NULL;
+     }
+     __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+     m->addr = addr;
+     m->len = len;
+     m->gen = gen;
+     __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+     if (stale_addr)
+          munmap(stale_addr, stale_len);
+     npheap_retired_unmap(stale);
+     return 0;
+}
+
+// Empties the entry and unmaps every mapping of the object it handed out.
+static void npheap_cache_drop(int devfd, __u64 offset)
+{
+     struct npheap_mapping *m = npheap_cache_find(devfd, offset);
+     struct npheap_retired *r;
+     void *addr;
+     size_t len;
+     if (!m)
+          return;
+     pthread_mutex_lock(&npheap_cache_lock);
+     addr = m->addr;
+     len = m->len;
+     r = m->retired;
+     m->retired = NULL;
+     __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+     m->addr = NULL;
+     m->len = 0;
+     __atomic_store_n(&m->seq, m->seq + 1, __ATOMIC_RELEASE);
+     pthread_mutex_unlock(&npheap_cache_lock);
+     if (addr)
+          munmap(addr, len);
+     npheap_retired_unmap(r);
+}
+
+// MAP_POPULATE skips the VM_PFNMAP mappings the module uses for huge
+// objects, so prefaulting a device mapping also writes every page with
+// an atomic no-op: the first write to a chunk maps all of it.
+static void npheap_prefault(void *addr, size_t len)
+{
+     size_t i;
+     for (i = 0; i < len; i += getpagesize())
+          __atomic_fetch_or((char *)addr + i, 0, __ATOMIC_RELAXED);
+}
+
+// Pages are allocated on first touch. NPHEAP_ALLOC_PREFAULT instead maps
+// every page of the object, huge ones included, before returning, for
+// readers that cannot afford a page fault per page. Mappings are cached: asking again for an
+// object that is already mapped at least size bytes long returns the
+// same address until npheap_delete() or npheap_release(). Asking for more
+// returns a new mapping, and the last NPHEAP_CACHE_RETIRED addresses
+// returned before stay valid until then too. Once the object has been
+// deleted and created again, by any process, the next call returns a
+// mapping of the new object and addresses of the old one become invalid.
+// NPHEAP_ALLOC_UNCACHED bypasses the cache and returns a new mapping of
+// the page-aligned size that belongs to the caller, who munmap()s it.
+void *npheap_alloc_flags(int devfd, __u64 offset, __u64 size, int flags)
 {
      __u64 aligned_size= ((size + getpagesize() - 1) / getpagesize())*getpagesize();
-     return mmap(0,aligned_size,PROT_READ|PROT_WRITE,MAP_SHARED,devfd,offset*getpagesize());
+     int mmap_flags = MAP_SHARED;
+     __u32 *genp = npheap_gen(devfd, offset);
+     __u32 gen = 0;
+     void *addr;
+     int ret;
+     if (flags & NPHEAP_ALLOC_PREFAULT)
+          mmap_flags |= MAP_POPULATE;
+     if (flags & NPHEAP_ALLOC_UNCACHED)
+          genp = NULL;
+     if (genp)
+     {
+          // Read the generation before mapping: if the object is deleted
+          // in between, the entry looks stale and is simply remapped.
+          gen = __atomic_load_n(genp, __ATOMIC_ACQUIRE);
+          if ((addr = npheap_cache_lookup(devfd, offset, gen, aligned_size)))
+               return addr;
+     }
+     if (npheap_shm_is(devfd))
+          addr = npheap_shm_alloc(devfd, offset, aligned_size, mmap_flags);
+     else
+     {
+          addr = mmap(0,aligned_size,PROT_READ|PROT_WRITE,mmap_flags,devfd,offset*getpagesize());
+          if (addr != MAP_FAILED && (flags & NPHEAP_ALLOC_PREFAULT))
+               npheap_prefault(addr, aligned_size);
+     }
+     if (addr == MAP_FAILED || !genp)
+          return addr;
+     pthread_mutex_lock(&npheap_cache_lock);
+     ret = npheap_cache_set(devfd, offset, gen, addr, aligned_size);
+     pthread_mutex_unlock(&npheap_cache_lock);
+     if (ret < 0)
+     {
+          // An untracked mapping could never be released.
+          munmap(addr, aligned_size);
+          errno = ENOMEM;
+          return MAP_FAILED;
+     }
+     return addr;
+}
+
+void *npheap_alloc(int devfd, __u64 offset, __u64 size)
+{
+     return npheap_alloc_flags(devfd, offset, size, 0);
+}
+
+// Unmaps every mapping of the object this process got from
+// npheap_alloc(), if any.
+void npheap_release(int devfd, __u64 offset)
+{
+     npheap_cache_drop(devfd, offset);
 }
+
+// A window maps objects first .. first+count-1 with a single mmap(), each
+// at a fixed stride, so touching many objects costs one VMA instead of
+// one per object. Objects appear in the window once they exist (through
+// npheap_alloc() or npheap_put() by any process) and vanish again when
+// deleted; reading a missing object faults with SIGBUS. A process has at
+// most one window.
+struct npheap_window {
+     char *base;
+     __u64 first;
+     __u64 count;
+     __u64 stride;
+};
+
+static struct npheap_window *npheap_window;
+
+void *npheap_window_map(int devfd, __u64 first, __u64 count)
+{
+     struct npheap_meta *meta;
+     struct npheap_window *win, *expected = NULL;
+     if (__atomic_load_n(&npheap_window, __ATOMIC_ACQUIRE))
+     {
+          errno = EBUSY;
+          return MAP_FAILED;
+     }
+     if (!count || !(win = malloc(sizeof(*win))))
+     {
+          errno = count ? ENOMEM : EINVAL;
+          return MAP_FAILED;
+     }
+     win->first = first;
+     win->count = count;
+     if (npheap_shm_is(devfd))
+          win->base = npheap_shm_window(devfd, first, count, &win->stride);
+     else if ((meta = npheap_meta_map(devfd)) == MAP_FAILED || !meta->window_stride)
+     {
+          errno = EOPNOTSUPP;
+          win->base = MAP_FAILED;
+     }
+     else
+     {
+          win->stride = meta->window_stride;
+          win->base = mmap(0,count*win->stride,PROT_READ|PROT_WRITE,MAP_SHARED,devfd,NPHEAP_WINDOW_OFFSET + first*win->stride);
+     }
+     if (win->base == MAP_FAILED)
+     {
+          free(win);
+          return MAP_FAILED;
+     }
+     if (!__atomic_compare_exchange_n(&npheap_window, &expected, win, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+     {
+          munmap(win->base, count*win->stride);
+          free(win);
+          errno = EBUSY;
+          return MAP_FAILED;
+     }
+     return win->base;
+}
+
+// Address of the object in this process's window, or NULL if there is
+// no window or the object lies outside it.
+void *npheap_window_get(int devfd, __u64 offset)
+{
+     struct npheap_window *win = __atomic_load_n(&npheap_window, __ATOMIC_ACQUIRE);
+     (void)devfd;
+     if (!win || offset < win->first || offset - win->first >= win->count)
+          return NULL;
+     return win->base + (offset - win->first)*win->stride;
+}
+
+// The writer that wins the lock word makes the seq count odd before it
+// touches the object, so that npheap_read_begin() callers back off.
 int npheap_lock(int devfd, __u64 offset)
 {
      struct npheap_cmd cmd;
+     struct npheap_slot *slot;
+     __u32 old = 0;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_lock(devfd, offset);
+     slot = npheap_slot(devfd, offset);
+     if (slot && __atomic_compare_exchange_n(&slot->lock, &old, NPHEAP_LOCK_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+     {
+          __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+          __atomic_thread_fence(__ATOMIC_RELEASE);
+          return 0;
+     }
      cmd.offset = offset*getpagesize();     
      return ioctl(devfd, NPHEAP_IOCTL_LOCK, &cmd);
 }
 
+// Like npheap_lock(), but fails with EBUSY instead of waiting.
+int npheap_trylock(int devfd, __u64 offset)
+{
+     struct npheap_cmd cmd;
+     struct npheap_slot *slot;
+     __u32 old = 0;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_lock_timeout(devfd, offset, 0);
+     slot = npheap_slot(devfd, offset);
+     if (slot)
+     {
+          if (__atomic_compare_exchange_n(&slot->lock, &old, NPHEAP_LOCK_WRITER, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+          {
+               __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+               __atomic_thread_fence(__ATOMIC_RELEASE);
+               return 0;
+          }
+          // Only a free word with sleepers flagged needs the kernel.
+          if (old & ~NPHEAP_LOCK_WAITERS)
+          {
+               errno = EBUSY;
+               return -1;
+          }
+     }
+     cmd.offset = offset*getpagesize();
+     return ioctl(devfd, NPHEAP_IOCTL_TRYLOCK, &cmd);
+}
+
+static int npheap_cmp_offset(const void *a, const void *b)
+{
+     __u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+     return x < y ? -1 : x > y;
+}
+
+// The shared-memory backend takes the locks one by one in the same
+// ascending order the kernel uses.
+static int npheap_lock_many_emulate(int devfd, const __u64 *offsets, int n, int timeout_ms)
+{
+     __u64 sorted[NPHEAP_LOCK_MANY_MAX];
+     struct timespec start, now;
+     int i, m = 0, locked, left = timeout_ms, err;
+     memcpy(sorted, offsets, n*sizeof(sorted[0]));
+     qsort(sorted, n, sizeof(sorted[0]), npheap_cmp_offset);
+     for (i = 0; i < n; i++)
+          if (!m || sorted[i] != sorted[m - 1])
+               sorted[m++] = sorted[i];
+     clock_gettime(CLOCK_MONOTONIC, &start);
+     for (locked = 0; locked < m; locked++)
+     {
+          if (timeout_ms > 0)
+          {
+               clock_gettime(CLOCK_MONOTONIC, &now);
+               left = timeout_ms - ((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000);
+               if (left < 1)
+                    left = 1;
+          }
+          if (npheap_shm_lock_timeout(devfd, sorted[locked], left) < 0)
+          {
+               err = errno;
+               for (i = 0; i < locked; i++)
+                    npheap_shm_unlock(devfd, sorted[i]);
+               errno = err;
+               return -1;
+          }
+     }
+     return 0;
+}
+
+// Write-locks up to NPHEAP_LOCK_MANY_MAX objects with one system call.
+// The locks are taken in a global order, so two callers locking
+// overlapping sets cannot deadlock. If timeout_ms (negative for no limit)
+// runs out, fails with ETIMEDOUT and holds none of the locks. Release
+// each object with npheap_unlock().
+int npheap_lock_many_timeout(int devfd, const __u64 *offsets, int n, int timeout_ms)
+{
+     __u64 bytes[NPHEAP_LOCK_MANY_MAX];
+     struct npheap_lock_many req;
+     int i;
+     if (n < 0 || n > NPHEAP_LOCK_MANY_MAX)
+     {
+          errno = n < 0 ? EINVAL : E2BIG;
+          return -1;
+     }
+     if (npheap_shm_is(devfd))
+          return npheap_lock_many_emulate(devfd, offsets, n, timeout_ms);
+     for (i = 0; i < n; i++)
+          bytes[i] = offsets[i]*getpagesize();
+     req.count = n;
+     req.offsets = bytes;
+     req.timeout_ms = timeout_ms;
+     req.reserved = 0;
+     return ioctl(devfd, NPHEAP_IOCTL_LOCK_MANY, &req);
+}
+
+int npheap_lock_many(int devfd, const __u64 *offsets, int n)
+{
+     return npheap_lock_many_timeout(devfd, offsets, n, -1);
+}
+
+int npheap_timedlock(int devfd, __u64 offset, int timeout_ms)
+{
+     return npheap_lock_many_timeout(devfd, &offset, 1, timeout_ms);
+}
+
+int npheap_rdlock(int devfd, __u64 offset)
+{
+     struct npheap_cmd cmd;
+     __u32 *word;
+     __u32 old;
+     // The shared-memory backend only has exclusive locks.
+     if (npheap_shm_is(devfd))
+          return npheap_shm_lock(devfd, offset);
+     word = npheap_lockword(devfd, offset);
+     if (word)
+     {
+          old = __atomic_load_n(word, __ATOMIC_RELAXED);
+          while (!(old & NPHEAP_LOCK_WRITER) && (old & NPHEAP_LOCK_READERS) != NPHEAP_LOCK_READERS)
+          {
+               if (__atomic_compare_exchange_n(word, &old, old + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                    return 0;
+          }
+     }
+     cmd.offset = offset*getpagesize();     
+     return ioctl(devfd, NPHEAP_IOCTL_RDLOCK, &cmd);
+}
+
+// Only a release that has to wake sleepers needs the kernel. Releasing a
+// write lock bumps the object's version and seq count first, so that
+// npheap_wait() callers see the write once the lock is free. If a sleeper
+// shows up meanwhile, the kernel bumps seq as well, so it is made odd
+// again before going there.
 int npheap_unlock(int devfd, __u64 offset)
 {
      struct npheap_cmd cmd;
+     struct npheap_slot *slot;
+     __u32 *word;
+     __u32 old;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_unlock(devfd, offset);
+     slot = npheap_slot(devfd, offset);
+     if (slot)
+     {
+          word = &slot->lock;
+          old = __atomic_load_n(word, __ATOMIC_RELAXED);
+          if (old == NPHEAP_LOCK_WRITER)
+          {
+               __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+               __atomic_add_fetch(&slot->version, 1, __ATOMIC_RELEASE);
+               if (__atomic_compare_exchange_n(word, &old, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                    return 0;
+               __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+          }
+          while (!(old & NPHEAP_LOCK_WAITERS) && old != 0)
+          {
+               if (__atomic_compare_exchange_n(word, &old, (old & NPHEAP_LOCK_WRITER) ? 0 : old - 1, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                    return 0;
+          }
+     }
      cmd.offset = offset*getpagesize();     
      return ioctl(devfd, NPHEAP_IOCTL_UNLOCK, &cmd);
 }
 
+// Optimistic reads: copy the object between npheap_read_begin() and
+// npheap_read_retry() and start over while the latter returns 1.
+//
+//     do {
+//          seq = npheap_read_begin(devfd, offset);
+//          memcpy(buf, obj, len);
+//     } while ((ret = npheap_read_retry(devfd, offset, seq)) > 0);
+//
+// Only writes made under npheap_lock() are detected. While no writer
+// holds the object this costs two loads of the shared seq count. A
+// reader that keeps finding a writer, or an object without a slot in the
+// metadata area, falls back to a shared lock, which npheap_read_retry()
+// releases; the odd value returned marks that case. If that lock cannot
+// be taken, npheap_read_begin() returns NPHEAP_READ_ERROR with errno set
+// and npheap_read_retry() then returns -1 without unlocking: the copy
+// was made unprotected and must be discarded.
+#define NPHEAP_READ_SPINS 128
+
+__u32 npheap_read_begin(int devfd, __u64 offset)
+{
+     __u32 *seqp = npheap_seq(devfd, offset);
+     __u32 seq;
+     int i;
+     if (seqp)
+     {
+          for (i = 0; i < NPHEAP_READ_SPINS; i++)
+          {
+               seq = __atomic_load_n(seqp, __ATOMIC_ACQUIRE);
+               if (!(seq & 1))
+                    return seq;
+          }
+     }
+     if (npheap_rdlock(devfd, offset) < 0)
+          return NPHEAP_READ_ERROR;
+     return 1;
+}
+
+int npheap_read_retry(int devfd, __u64 offset, __u32 seq)
+{
+     if (seq == NPHEAP_READ_ERROR)
+          return -1;
+     if (seq & 1)
+          return npheap_unlock(devfd, offset) < 0 ? -1 : 0;
+     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+     return __atomic_load_n(npheap_seq(devfd, offset), __ATOMIC_RELAXED) != seq;
+}
+
+// Blocks until the object's version differs from last_version, which
+// happens on every write unlock, npheap_put() and npheap_delete() of it,
+// or until timeout_ms milliseconds pass (never if negative). Returns the
+// new version, or -1 with errno ETIMEDOUT if the object did not change.
+// Pass the value returned by npheap_version() to wait for the next
+// change after it.
+long npheap_wait(int devfd, __u64 offset, __u32 last_version, int timeout_ms)
+{
+     struct npheap_wait wait;
+     struct npheap_slot *slot;
+     __u32 version;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_wait(devfd, offset, last_version, timeout_ms);
+     slot = npheap_slot(devfd, offset);
+     if (slot && (version = __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE)) != last_version)
+          return version;
+     wait.offset = offset*getpagesize();
+     wait.version = last_version;
+     wait.timeout_ms = timeout_ms;
+     if (ioctl(devfd, NPHEAP_IOCTL_WAIT, &wait) < 0)
+          return -1;
+     return wait.version;
+}
+
+// Only reads the version: objects with a slot in the metadata area are
+// looked up there, others by a WAIT that returns at once.
+long npheap_version(int devfd, __u64 offset)
+{
+     struct npheap_slot *slot;
+     long version;
+     if (!npheap_shm_is(devfd) && (slot = npheap_slot(devfd, offset)))
+          return __atomic_load_n(&slot->version, __ATOMIC_ACQUIRE);
+     version = npheap_wait(devfd, offset, 0, 0);
+     return version < 0 && errno == ETIMEDOUT ? 0 : version;
+}
+
+// Makes poll() on devfd report POLLIN once the object's version differs
+// from last_version. Each descriptor watches one object; open the device
+// once per object to watch several with epoll.
+int npheap_watch(int devfd, __u64 offset, __u32 last_version)
+{
+     struct npheap_wait wait;
+     if (npheap_shm_is(devfd))
+     {
+          errno = EOPNOTSUPP;
+          return -1;
+     }
+     wait.offset = offset*getpagesize();
+     wait.version = last_version;
+     wait.timeout_ms = 0;
+     return ioctl(devfd, NPHEAP_IOCTL_WATCH, &wait);
+}
+
 int npheap_delete(int devfd, __u64 offset)
 {
      struct npheap_cmd cmd;
+     int ret;
      cmd.offset = offset*getpagesize();
-     return ioctl(devfd, NPHEAP_IOCTL_DELETE, &cmd);
+     if (npheap_shm_is(devfd))
+          ret = npheap_shm_delete(devfd, offset);
+     else
+          ret = ioctl(devfd, NPHEAP_IOCTL_DELETE, &cmd);
+     if (ret == 0)
+          npheap_cache_drop(devfd, offset);
+     return ret;
+}
+
+// Resizes the object in place, keeping its contents up to the smaller of
+// the two sizes without copying them, and returns a mapping of the new
+// size, or MAP_FAILED. Addresses npheap_alloc() returned before stay
+// mapped as described there, but keep their old length: they reach no
+// further than that or the new size, whichever is smaller. Use the
+// returned address for the rest. Call with the object locked.
+void *npheap_realloc(int devfd, __u64 offset, __u64 size)
+{
+     struct npheap_cmd cmd;
+     int ret;
+     if (npheap_shm_is(devfd))
+          ret = npheap_shm_resize(devfd, offset, size);
+     else
+     {
+          cmd.offset = offset*getpagesize();
+          cmd.size = size;
+          ret = ioctl(devfd, NPHEAP_IOCTL_RESIZE, &cmd);
+     }
+     if (ret < 0)
+          return MAP_FAILED;
+     return npheap_alloc(devfd, offset, size);
 }
 
 long npheap_getsize(int devfd, __u64 offset)
 {
      struct npheap_cmd cmd;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_getsize(devfd, offset);
      cmd.offset = offset*getpagesize();
      return ioctl(devfd, NPHEAP_IOCTL_GETSIZE, &cmd);
 }
+
+// Copy-based access for small values: no lock, mapping or page fault is
+// needed, and values of up to a couple of KiB are stored packed in the
+// kernel instead of taking a page each. npheap_get() returns the object's
+// size, which may exceed len if the buffer was too short.
+long npheap_get(int devfd, __u64 offset, void *buf, __u64 len)
+{
+     struct npheap_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     cmd.size = len;
+     cmd.data = buf;
+     return ioctl(devfd, NPHEAP_IOCTL_GET, &cmd);
+}
+
+int npheap_put(int devfd, __u64 offset, const void *buf, __u64 len)
+{
+     struct npheap_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     cmd.size = len;
+     cmd.data = (void *)buf;
+     return ioctl(devfd, NPHEAP_IOCTL_PUT, &cmd);
+}
+
+// Reports the object's size, how much backing it has allocated, whether
+// that backing uses huge pages and which NUMA nodes it lives on.
+int npheap_objstat(int devfd, __u64 offset, struct npheap_objstat *st)
+{
+     struct npheap_cmd cmd;
+     cmd.offset = offset*getpagesize();
+     cmd.data = st;
+     return ioctl(devfd, NPHEAP_IOCTL_OBJSTAT, &cmd);
+}
+
+// Chooses the NUMA nodes the object's pages are allocated on from now
+// on: policy is one of NPHEAP_NUMA_* and nodes a mask of node numbers
+// (0 for all). The shared-memory backend leaves placement to the kernel.
+int npheap_numa(int devfd, __u64 offset, __u32 policy, __u64 nodes)
+{
+     struct npheap_numa numa;
+     struct npheap_cmd cmd;
+     if (npheap_shm_is(devfd))
+     {
+          errno = EOPNOTSUPP;
+          return -1;
+     }
+     memset(&numa, 0, sizeof(numa));
+     numa.policy = policy;
+     numa.nodes = nodes;
+     cmd.offset = offset*getpagesize();
+     cmd.data = &numa;
+     return ioctl(devfd, NPHEAP_IOCTL_NUMA, &cmd);
+}
+
+// Iterates over the live objects in offset order. Start with *cursor set
+// to 0 and call until it returns 0; each call stores up to count
+// (object number, size) pairs in entries and advances *cursor. Returns
+// the number of entries stored, or -1 on error.
+long npheap_list(int devfd, __u64 *cursor, struct npheap_list_entry *entries, __u64 count)
+{
+     struct npheap_list list;
+     long ret, i;
+     if (npheap_shm_is(devfd))
+          return npheap_shm_list(devfd, cursor, entries, count);
+     list.cursor = *cursor*getpagesize();
+     list.count = count;
+     list.entries = entries;
+     if ((ret = ioctl(devfd, NPHEAP_IOCTL_LIST, &list)) < 0)
+          return ret;
+     for (i = 0; i < ret; i++)
+          entries[i].offset /= getpagesize();
+     *cursor = list.cursor/getpagesize();
+     return ret;
+}
+
+// Copies the module's counters and latency histograms, summed over all
+// CPUs; see struct npheap_stats. The shared-memory backend keeps none.
+int npheap_stats(int devfd, struct npheap_stats *st)
+{
+     struct npheap_cmd cmd;
+     if (npheap_shm_is(devfd))
+     {
+          errno = EOPNOTSUPP;
+          return -1;
+     }
+     cmd.data = st;
+     return ioctl(devfd, NPHEAP_IOCTL_STATS, &cmd);
+}
+
+// The shared-memory backend has no system call to save, so batches
+// simply run command by command.
+static long npheap_batch_emulate(int devfd, const struct npheap_cmd *cmds, __s64 *results, __u64 count)
+{
+     __u64 i;
+     long ret;
+     for (i = 0; i < count; i++)
+     {
+          switch (cmds[i].op)
+          {
+          case NPHEAP_OP_LOCK:
+          case NPHEAP_OP_RDLOCK:
+               ret = npheap_lock(devfd, cmds[i].offset);
+               break;
+          case NPHEAP_OP_UNLOCK:
+               ret = npheap_unlock(devfd, cmds[i].offset);
+               break;
+          case NPHEAP_OP_TRYLOCK:
+               ret = npheap_trylock(devfd, cmds[i].offset);
+               break;
+          case NPHEAP_OP_RESIZE:
+               ret = npheap_shm_resize(devfd, cmds[i].offset, cmds[i].size);
+               break;
+          case NPHEAP_OP_GETSIZE:
+               ret = npheap_getsize(devfd, cmds[i].offset);
+               break;
+          case NPHEAP_OP_DELETE:
+               ret = npheap_delete(devfd, cmds[i].offset);
+               break;
+          default:
+               ret = -1;
+               errno = ENOTTY;
+          }
+          results[i] = ret < 0 ? -errno : ret;
+     }
+     return count;
+}
+
+// Executes count commands with one ioctl() per NPHEAP_BATCH_MAX of them.
+// Offsets in cmds are object numbers, as everywhere else in this library;
+// results[i] receives what the single-command call would have returned.
+// Returns the number of commands executed, or -1 on error.
+long npheap_batch(int devfd, const struct npheap_cmd *cmds, __s64 *results, __u64 count)
+{
+     struct npheap_cmd chunk[NPHEAP_BATCH_MAX];
+     struct npheap_batch batch;
+     __u64 done, i;
+     long ret;
+     if (npheap_shm_is(devfd))
+          return npheap_batch_emulate(devfd, cmds, results, count);
+     for (done = 0; done < count; done += batch.count)
+     {
+          batch.count = count - done < NPHEAP_BATCH_MAX ? count - done : NPHEAP_BATCH_MAX;
+          batch.cmds = chunk;
+          batch.results = results + done;
+          for (i = 0; i < batch.count; i++)
+          {
+               chunk[i] = cmds[done + i];
+               chunk[i].offset *= getpagesize();
+          }
+          ret = ioctl(devfd, NPHEAP_IOCTL_BATCH, &batch);
+          if (ret < 0)
+               return ret;
+          for (i = 0; i < (__u64)ret; i++)
+               if (chunk[i].op == NPHEAP_OP_DELETE && batch.results[i] == 0)
+                    npheap_cache_drop(devfd, cmds[done + i].offset);
+          if ((__u64)ret < batch.count)
+               return done + ret;
+     }
+     return done;
+}
@@ -2,11 +2,41 @@
 extern "C" {
 #endif
 #include <linux/types.h>
+#include <npheap/npheap.h>
+#define NPHEAP_BACKEND_DEFAULT 0
+#define NPHEAP_BACKEND_DEVICE  1
+#define NPHEAP_BACKEND_SHM     2
+int npheap_open(int backend);
+#define NPHEAP_ALLOC_PREFAULT 0x1
+#define NPHEAP_ALLOC_UNCACHED 0x2
 void *npheap_alloc(int devfd, __u64 offset, __u64 size);
+void *npheap_alloc_flags(int devfd, __u64 offset, __u64 size, int flags);
+void npheap_release(int devfd, __u64 offset);
+void *npheap_window_map(int devfd, __u64 first, __u64 count);
+void *npheap_window_get(int devfd, __u64 offset);
 int npheap_lock(int devfd, __u64 offset);
+int npheap_trylock(int devfd, __u64 offset);
+int npheap_timedlock(int devfd, __u64 offset, int timeout_ms);
+int npheap_lock_many(int devfd, const __u64 *offsets, int n);
+int npheap_lock_many_timeout(int devfd, const __u64 *offsets, int n, int timeout_ms);
+int npheap_rdlock(int devfd, __u64 offset);
 int npheap_unlock(int devfd, __u64 offset);
 int npheap_delete(int devfd, __u64 offset);
+#define NPHEAP_READ_ERROR ((__u32)-1)
+__u32 npheap_read_begin(int devfd, __u64 offset);
+int npheap_read_retry(int devfd, __u64 offset, __u32 seq);
+long npheap_wait(int devfd, __u64 offset, __u32 last_version, int timeout_ms);
+long npheap_version(int devfd, __u64 offset);
+int npheap_watch(int devfd, __u64 offset, __u32 last_version);
+void *npheap_realloc(int devfd, __u64 offset, __u64 size);
 long npheap_getsize(int devfd, __u64 offset);
+long npheap_get(int devfd, __u64 offset, void *buf, __u64 len);
+int npheap_put(int devfd, __u64 offset, const void *buf, __u64 len);
+int npheap_objstat(int devfd, __u64 offset, struct npheap_objstat *st);
+int npheap_numa(int devfd, __u64 offset, __u32 policy, __u64 nodes);
+int npheap_stats(int devfd, struct npheap_stats *st);
+long npheap_list(int devfd, __u64 *cursor, struct npheap_list_entry *entries, __u64 count);
+long npheap_batch(int devfd, const struct npheap_cmd *cmds, __s64 *results, __u64 count);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,279 @@
+#ifndef NPHEAP_HPP
+#define NPHEAP_HPP
+// C++20 wrapper around libnpheap, header only.
+//
+// npheap::Object<T> is a move-only handle to one object viewed as an
+// array of T (std::byte by default). It owns a private mapping of the
+// object, which it munmap()s when destroyed, and remembers the object's
+// size, so size() and data() cost no system call however often they are
+// called. The mapping is private to the handle rather than taken from
+// libnpheap's per-process cache, so handles never unmap each other's
+// memory.
+//
+// ExclusiveLock and SharedLock hold an object's lock for their lifetime.
+// Errors are reported by throwing std::system_error with the errno
+// libnpheap left behind.
+#include <npheap.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <span>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+namespace npheap
+{
+
+[[noreturn]] inline void throw_errno(const char *what)
+{
+     throw std::system_error(errno, std::generic_category(), what);
+}
+
+template <typename T = std::byte>
+class Object
+{
+     static_assert(std::is_trivially_copyable_v<T>, "npheap objects hold raw memory shared between processes");
+     static_assert(!std::is_const_v<T> && !std::is_volatile_v<T>, "qualify the handle, not T");
+     static_assert(sizeof(T) > 0, "T must be a complete type");
+
+public:
+     Object() = default;
+
+     // Maps the object at offset, creating it with room for count
+     // elements if it does not exist yet. An existing object keeps its
+     // size, which must hold at least count elements.
+     Object(int devfd, __u64 offset, std::size_t count = 1)
+          : devfd_(devfd), offset_(offset)
+     {
+          long size = npheap_getsize(devfd, offset);
+          if (size < 0)
+               throw_errno("npheap_getsize");
+          // Checked before mapping: a throwing constructor runs no
+          // destructor to unmap it again.
+          if (size && static_cast<std::size_t>(size) < count * sizeof(T))
+               throw std::system_error(EOVERFLOW, std::generic_category(), "npheap object too small");
+          map(size ? static_cast<std::size_t>(size) : count * sizeof(T));
+     }
+
+     // Maps an existing object at its current size; fails with ENOENT if
+     // there is none.
+     static Object open(int devfd, __u64 offset)
+     {
+          Object obj;
+          long size = npheap_getsize(devfd, offset);
+          if (size < 0)
+               throw_errno("npheap_getsize");
+          if (size == 0)
+               throw std::system_error(ENOENT, std::generic_category(), "npheap object");
+          if (static_cast<std::size_t>(size) < sizeof(T))
+               throw std::system_error(EOVERFLOW, std::generic_category(), "npheap object too small");
+          obj.devfd_ = devfd;
+          obj.offset_ = offset;
+          obj.map(size);
+          return obj;
+     }
+
+     Object(const Object &) = delete;
+     Object &operator=(const Object &) = delete;
+
+     Object(Object &&other) noexcept
+          : devfd_(other.devfd_), offset_(other.offset_),
+            addr_(std::exchange(other.addr_, nullptr)),
+            size_(std::exchange(other.size_, 0)),
+            mapped_(std::exchange(other.mapped_, 0))
+     {
+     }
+
+     Object &operator=(Object &&other) noexcept
+     {
+          if (this != &other)
+          {
+               reset();
+               devfd_ = other.devfd_;
+               offset_ = other.offset_;
+               addr_ = std::exchange(other.addr_, nullptr);
+               size_ = std::exchange(other.size_, 0);
+               mapped_ = std::exchange(other.mapped_, 0);
+          }
+          return *this;
+     }
+
+     ~Object()
+     {
+          reset();
+     }
+
+     // Unmaps the object; the object itself stays in the heap.
+     void reset() noexcept
+     {
+          if (addr_)
+               munmap(addr_, mapped_);
+          addr_ = nullptr;
+          size_ = mapped_ = 0;
+     }
+
+     explicit operator bool() const noexcept { return addr_ != nullptr; }
+     int devfd() const noexcept { return devfd_; }
+     __u64 offset() const noexcept { return offset_; }
+
+     // Size of the object in bytes when it was mapped.
+     std::size_t size_bytes() const noexcept { return size_; }
+     std::size_t size() const noexcept { return size_ / sizeof(T); }
+
+     T *get() const noexcept { return static_cast<T *>(addr_); }
+     std::span<T> data() const noexcept { return {get(), size()}; }
+     std::span<std::byte> bytes() const noexcept { return {static_cast<std::byte *>(addr_), size_}; }
+     T &operator*() const noexcept { return *get(); }
+     T *operator->() const noexcept { return get(); }
+     T &operator[](std::size_t i) const noexcept { return get()[i]; }
+
+     // Deletes the object from the heap and drops this mapping. Other
+     // processes' mappings keep the old contents until they go away.
+     void remove()
+     {
+          if (npheap_delete(devfd_, offset_) < 0)
+               throw_errno("npheap_delete");
+          reset();
+     }
+
+private:
+     void map(std::size_t size)
+     {
+          std::size_t page = getpagesize();
+          void *addr = npheap_alloc_flags(devfd_, offset_, size, NPHEAP_ALLOC_UNCACHED);
+          if (addr == MAP_FAILED || !addr)
+               throw_errno("npheap_alloc");
+          reset();
+          addr_ = addr;
+          size_ = size;
+          mapped_ = (size + page - 1) / page * page;
+     }
+
+     int devfd_ = -1;
+     __u64 offset_ = 0;
+     void *addr_ = nullptr;
+     std::size_t size_ = 0;
+     std::size_t mapped_ = 0;
+};
+
+// Holds an object's lock from construction to destruction. Lockers are
+// built from the lock and unlock calls of libnpheap, so the uncontended
+// case stays in user space.
+template <int (*Acquire)(int, __u64), const char *Name>
+class BasicLock
+{
+public:
+     BasicLock(int devfd, __u64 offset)
+          : devfd_(devfd), offset_(offset)
+     {
+          if (Acquire(devfd, offset) < 0)
+               throw_errno(Name);
+          owns_ = true;
+     }
+
+     template <typename T>
+     explicit BasicLock(const Object<T> &obj)
+          : BasicLock(obj.devfd(), obj.offset())
+     {
+     }
+
+     BasicLock(const BasicLock &) = delete;
+     BasicLock &operator=(const BasicLock &) = delete;
+
+     BasicLock(BasicLock &&other) noexcept
+          : devfd_(other.devfd_), offset_(other.offset_), owns_(std::exchange(other.owns_, false))
+     {
+     }
+
+     BasicLock &operator=(BasicLock &&other) noexcept
+     {
+          if (this != &other)
+          {
+               unlock();
+               devfd_ = other.devfd_;
+               offset_ = other.offset_;
+               owns_ = std::exchange(other.owns_, false);
+          }
+          return *this;
+     }
+
+     ~BasicLock()
+     {
+          unlock();
+     }
+
+     void unlock() noexcept
+     {
+          if (owns_)
+               npheap_unlock(devfd_, offset_);
+          owns_ = false;
+     }
+
+     bool owns_lock() const noexcept { return owns_; }
+     explicit operator bool() const noexcept { return owns_; }
+
+protected:
+     BasicLock(int devfd, __u64 offset, bool owns) noexcept
+          : devfd_(devfd), offset_(offset), owns_(owns)
+     {
+     }
+
+private:
+     int devfd_;
+     __u64 offset_;
+     bool owns_ = false;
+};
+
+inline constexpr char lock_name[] = "npheap_lock";
+inline constexpr char rdlock_name[] = "npheap_rdlock";
+
+using SharedLock = BasicLock<npheap_rdlock, rdlock_name>;
+
+// The exclusive lock can also be tried or waited for with a timeout, in
+// which case owns_lock() tells whether it was taken.
+class ExclusiveLock : public BasicLock<npheap_lock, lock_name>
+{
+     using Base = BasicLock<npheap_lock, lock_name>;
+
+public:
+     using Base::Base;
+
+     ExclusiveLock(int devfd, __u64 offset, std::try_to_lock_t)
+          : Base(devfd, offset, acquired(npheap_trylock(devfd, offset), "npheap_trylock"))
+     {
+     }
+
+     ExclusiveLock(int devfd, __u64 offset, std::chrono::milliseconds timeout)
+          : Base(devfd, offset, acquired(npheap_timedlock(devfd, offset, static_cast<int>(timeout.count())), "npheap_timedlock"))
+     {
+     }
+
+     template <typename T>
+     ExclusiveLock(const Object<T> &obj, std::try_to_lock_t t)
+          : ExclusiveLock(obj.devfd(), obj.offset(), t)
+     {
+     }
+
+     template <typename T>
+     ExclusiveLock(const Object<T> &obj, std::chrono::milliseconds timeout)
+          : ExclusiveLock(obj.devfd(), obj.offset(), timeout)
+     {
+     }
+
+private:
+     static bool acquired(int ret, const char *what)
+     {
+          if (ret == 0)
+               return true;
+          if (errno == EBUSY || errno == ETIMEDOUT)
+               return false;
+          throw_errno(what);
+     }
+};
+
+}
+#endif
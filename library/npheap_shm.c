@@ -0,0 +1,395 @@
+#include "npheap.h"
+#include "npheap_shm.h"
+#include <npheap/npheap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+// A user-space stand-in for /dev/npheap, for machines where the module
+// cannot be loaded and as a baseline for the kernel path. The heap is a
+// POSIX shared memory object, so like the device it outlives the
+// processes using it. It starts with a header and a table of
+// NPHEAP_SHM_OBJECTS entries, each holding a process-shared robust mutex
+// (the object lock) and the object's size. Object N's data lives at a
+// fixed position: N * NPHEAP_SHM_MAX_SIZE past the table. tmpfs only
+// allocates what is written, and delete punches the range out again.
+//
+// The segment is named by $NPHEAP_SHM_NAME (default /npheap); its
+// geometry is read from $NPHEAP_SHM_OBJECTS and $NPHEAP_SHM_MAX_SIZE by
+// whichever process creates it. Shared locks are exclusive here, and a
+// mapping of a deleted object reads zeroes rather than the old contents.
+// Every unlock counts as a write for npheap_wait().
+#define NPHEAP_SHM_MAGIC 0x4e505348
+
+struct npheap_shm_entry {
+     pthread_mutex_t lock;
+     __u64 size;
+     __u32 gen;
+     __u32 version;		// futex word for npheap_shm_wait()
+     __u32 watchers;
+     __u32 seq;		// odd while the lock is held
+};
+
+struct npheap_shm_header {
+     __u32 magic;
+     __u32 nobjects;
+     __u64 max_size;
+     __u64 data_start;
+     struct npheap_shm_entry entries[];
+};
+
+// A process opens the segment once; later opens return the same
+// descriptor, so every descriptor npheap_shm_is() accepts sees the
+// header below.
+static int npheap_shm_fd = -1;
+static struct npheap_shm_header *npheap_shm;
+static pthread_mutex_t npheap_shm_open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// How long an opener waits for the creator to initialize the segment.
+// A creator that died first leaves it uninitialized for good; removing
+// /dev/shm/npheap (or $NPHEAP_SHM_NAME) lets the next opener recreate it.
+#define NPHEAP_SHM_INIT_TIMEOUT_MS 5000
+
+static __u64 npheap_shm_env(const char *name, __u64 def)
+{
+     const char *value = getenv(name);
+     return value ? strtoull(value, NULL, 0) : def;
+}
+
+static int npheap_shm_create(int fd)
+{
+     __u64 nobjects = npheap_shm_env("NPHEAP_SHM_OBJECTS", 65536);
+     __u64 max_size = npheap_shm_env("NPHEAP_SHM_MAX_SIZE", 1 << 20);
+     __u64 table, i;
+     pthread_mutexattr_t attr;
+     struct npheap_shm_header *hdr;
+     max_size = ((max_size + getpagesize() - 1) / getpagesize())*getpagesize();
+     table = sizeof(*hdr) + nobjects*sizeof(struct npheap_shm_entry);
+     table = ((table + getpagesize() - 1) / getpagesize())*getpagesize();
+     if (ftruncate(fd, table + nobjects*max_size) < 0)
+          return -1;
+     hdr = mmap(0,table,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+     if (hdr == MAP_FAILED)
+          return -1;
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     for (i = 0; i < nobjects; i++)
+          pthread_mutex_init(&hdr->entries[i].lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+     hdr->nobjects = nobjects;
+     hdr->max_size = max_size;
+     hdr->data_start = table;
+     // Publishing the magic last tells openers the table is ready.
+     __atomic_store_n(&hdr->magic, NPHEAP_SHM_MAGIC, __ATOMIC_RELEASE);
+     munmap(hdr, table);
+     return 0;
+}
+
+static int npheap_shm_attach(void)
+{
+     const char *name = getenv("NPHEAP_SHM_NAME");
+     struct npheap_shm_header *hdr;
+     struct stat st;
+     size_t table = 0;
+     int fd, waited;
+     if (!name)
+          name = "/npheap";
+     fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0666);
+     if (fd >= 0)
+     {
+          // Any user may use the heap, like /dev/npheap after chmod 777.
+          fchmod(fd, 0666);
+          if (npheap_shm_create(fd) < 0)
+          {
+               close(fd);
+               shm_unlink(name);
+               return -1;
+          }
+     }
+     else if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0)) < 0)
+          return -1;
+     // Wait for the creator to size and initialize the segment.
+     for (waited = 0;; waited++)
+     {
+          if (fstat(fd, &st) < 0)
+               goto fail;
+          if ((size_t)st.st_size >= sizeof(*hdr))
+          {
+               hdr = mmap(0,getpagesize(),PROT_READ,MAP_SHARED,fd,0);
+               if (hdr == MAP_FAILED)
+                    goto fail;
+               if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == NPHEAP_SHM_MAGIC)
+                    table = hdr->data_start;
+               munmap(hdr, getpagesize());
+               if (table)
+                    break;
+          }
+          if (waited == NPHEAP_SHM_INIT_TIMEOUT_MS)
+          {
+               errno = ETIMEDOUT;
+               goto fail;
+          }
+          usleep(1000);
+     }
+     hdr = mmap(0,table,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+     if (hdr == MAP_FAILED)
+          goto fail;
+     npheap_shm = hdr;
+     npheap_shm_fd = fd;
+     return fd;
+fail:
+     close(fd);
+     return -1;
+}
+
+int npheap_shm_open(void)
+{
+     int fd;
+     pthread_mutex_lock(&npheap_shm_open_lock);
+     fd = npheap_shm_fd >= 0 ? npheap_shm_fd : npheap_shm_attach();
+     pthread_mutex_unlock(&npheap_shm_open_lock);
+     return fd;
+}
+
+int npheap_shm_is(int devfd)
+{
+     return devfd >= 0 && devfd == npheap_shm_fd;
+}
+
+static struct npheap_shm_entry *npheap_shm_entry(__u64 offset)
+{
+     if (offset >= npheap_shm->nobjects)
+     {
+          errno = EINVAL;
+          return NULL;
+     }
+     return &npheap_shm->entries[offset];
+}
+
+// The first mapping of an object defines its size, as with the device.
+void *npheap_shm_alloc(int devfd, __u64 offset, __u64 size, int mmap_flags)
+{
+     struct npheap_shm_entry *e = npheap_shm_entry(offset);
+     __u64 old = 0;
+     if (!e)
+          return MAP_FAILED;
+     if (size > npheap_shm->max_size)
+     {
+          errno = EFBIG;
+          return MAP_FAILED;
+     }
+     __atomic_compare_exchange_n(&e->size, &old, size, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+     return mmap(0,size,PROT_READ|PROT_WRITE,mmap_flags,devfd,npheap_shm->data_start + offset*npheap_shm->max_size);
+}
+
+// Objects already sit max_size apart, so a window is one plain mapping
+// of the data area.
+void *npheap_shm_window(int devfd, __u64 first, __u64 count, __u64 *stride)
+{
+     if (first >= npheap_shm->nobjects || count > npheap_shm->nobjects - first)
+     {
+          errno = EINVAL;
+          return MAP_FAILED;
+     }
+     *stride = npheap_shm->max_size;
+     return mmap(0,count*npheap_shm->max_size,PROT_READ|PROT_WRITE,MAP_SHARED,devfd,npheap_shm->data_start + first*npheap_shm->max_size);
+}
+
+int npheap_shm_lock(int devfd, __u64 offset)
+{
+     return npheap_shm_lock_timeout(devfd, offset, -1);
+}
+
+// timeout_ms < 0 waits forever and 0 only tries, failing with EBUSY.
+int npheap_shm_lock_timeout(int devfd, __u64 offset, int timeout_ms)
+{
+     struct npheap_shm_entry *e = npheap_shm_entry(offset);
+     struct timespec end;
+     int ret;
+     (void)devfd;
+     if (!e)
+          return -1;
+     if (timeout_ms < 0)
+          ret = pthread_mutex_lock(&e->lock);
+     else if (timeout_ms == 0)
+          ret = pthread_mutex_trylock(&e->lock);
+     else
+     {
+          clock_gettime(CLOCK_REALTIME, &end);
+          end.tv_sec += timeout_ms / 1000;
+          end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+          if (end.tv_nsec >= 1000000000L)
+          {
+               end.tv_sec++;
+               end.tv_nsec -= 1000000000L;
+          }
+          ret = pthread_mutex_timedlock(&e->lock, &end);
+     }
+     // The previous holder died; the lock is ours and usable again, but
+     // its seq count may have been left odd.
+     if (ret == EOWNERDEAD)
+     {
+          ret = pthread_mutex_consistent(&e->lock);
+          if (e->seq & 1)
+               __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+     }
+     if (ret)
+     {
+          errno = ret;
+          return -1;
+     }
+     __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+     __atomic_thread_fence(__ATOMIC_RELEASE);
+     return 0;
+}
+
+// Waiters sleep on the version word itself, so a change only costs a
+// system call while someone is waiting.
+static void npheap_shm_changed(struct npheap_shm_entry *e)
+{
+     __atomic_add_fetch(&e->version, 1, __ATOMIC_SEQ_CST);
+     if (__atomic_load_n(&e->watchers, __ATOMIC_SEQ_CST))
+          syscall(SYS_futex, &e->version, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int npheap_shm_unlock(int devfd, __u64 offset)
+{
+     struct npheap_shm_entry *e = npheap_shm_entry(offset);
+     int ret;
+     (void)devfd;
+     if (!e)
+          return -1;
+     __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+     npheap_shm_changed(e);
+     if ((ret = pthread_mutex_unlock(&e->lock)))
+     {
+          errno = ret;
+          return -1;
+     }
+     return 0;
+}
+
+int npheap_shm_delete(int devfd, __u64 offset)
+{
+     struct npheap_shm_entry *e = npheap_shm_entry(offset);
+     if (!e)
+          return -1;
+     if (__atomic_exchange_n(&e->size, 0, __ATOMIC_ACQ_REL) == 0)
+          return 0;
+     __atomic_add_fetch(&e->gen, 1, __ATOMIC_RELEASE);
+     npheap_shm_changed(e);
+     return fallocate(devfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                      npheap_shm->data_start + offset*npheap_shm->max_size, npheap_shm->max_size);
+}
+
+// Shrinking punches out the cut tail, like delete does for all of it.
+int npheap_shm_resize(int devfd, __u64 offset, __u64 size)
+{
+     struct npheap_shm_entry *e = npheap_shm_entry(offset);
+     __u64 keep = ((size + getpagesize() - 1) / getpagesize())*getpagesize();
+     __u64 old;
+     if (!e)
+          return -1;
+     if (size > npheap_shm->max_size)
+     {
+          errno = EFBIG;
+          return -1;
+     }
+     old = __atomic_exchange_n(&e->size, size, __ATOMIC_ACQ_REL);
+     if (size < old && keep < npheap_shm->max_size &&
+         fallocate(devfd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                   npheap_shm->data_start + offset*npheap_shm->max_size + keep, npheap_shm->max_size - keep) < 0)
+          return -1;
+     if (size != old)
+          npheap_shm_changed(e);
+     return 0;
+}
+
+long npheap_shm_getsize(int devfd, __u64 offset)
+{
+     struct npheap_shm_entry *e = npheap_shm_entry(offset);
+     (void)devfd;
+     return e ? (long)__atomic_load_n(&e->size, __ATOMIC_ACQUIRE) : 0;
+}
+
+long npheap_shm_list(int devfd, __u64 *cursor, struct npheap_list_entry *entries, __u64 count)
+{
+     __u64 n = 0, size;
+     (void)devfd;
+     for (; *cursor < npheap_shm->nobjects && n < count; (*cursor)++)
+     {
+          size = __atomic_load_n(&npheap_shm->entries[*cursor].size, __ATOMIC_ACQUIRE);
+          if (!size)
+               continue;
+          entries[n].offset = *cursor;
+          entries[n].size = size;
+          n++;
+     }
+     return n;
+}
+
+long npheap_shm_wait(int devfd, __u64 offset, __u32 last_version, int timeout_ms)
+{
+     struct npheap_shm_entry *e = npheap_shm_entry(offset);
+     struct timespec now, end, left;
+     __u32 version;
+     (void)devfd;
+     if (!e)
+          return -1;
+     clock_gettime(CLOCK_MONOTONIC, &end);
+     end.tv_sec += timeout_ms / 1000;
+     end.tv_nsec += (timeout_ms % 1000) * 1000000L;
+     if (end.tv_nsec >= 1000000000L)
+     {
+          end.tv_sec++;
+          end.tv_nsec -= 1000000000L;
+     }
+     __atomic_add_fetch(&e->watchers, 1, __ATOMIC_SEQ_CST);
+     while ((version = __atomic_load_n(&e->version, __ATOMIC_SEQ_CST)) == last_version)
+     {
+          if (timeout_ms >= 0)
+          {
+               clock_gettime(CLOCK_MONOTONIC, &now);
+               left.tv_sec = end.tv_sec - now.tv_sec;
+               left.tv_nsec = end.tv_nsec - now.tv_nsec;
+               if (left.tv_nsec < 0)
+               {
+                    left.tv_sec--;
+                    left.tv_nsec += 1000000000L;
+               }
+               if (left.tv_sec < 0)
+                    break;
+          }
+          syscall(SYS_futex, &e->version, FUTEX_WAIT, last_version, timeout_ms >= 0 ? &left : NULL, NULL, 0);
+     }
+     __atomic_sub_fetch(&e->watchers, 1, __ATOMIC_SEQ_CST);
+     if (version == last_version)
+     {
+          errno = ETIMEDOUT;
+          return -1;
+     }
+     return version;
+}
+
+__u32 *npheap_shm_gen(int devfd, __u64 offset)
+{
+     (void)devfd;
+     return offset < npheap_shm->nobjects ? &npheap_shm->entries[offset].gen : NULL;
+}
+
+__u32 *npheap_shm_seq(int devfd, __u64 offset)
+{
+     (void)devfd;
+     return offset < npheap_shm->nobjects ? &npheap_shm->entries[offset].seq : NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef NPHEAP_SHM_H
+#define NPHEAP_SHM_H
+#include <linux/types.h>
+#include <npheap/npheap.h>
+// Shared-memory backend of libnpheap; see npheap_shm.c.
+int npheap_shm_open(void);
+int npheap_shm_is(int devfd);
+void *npheap_shm_alloc(int devfd, __u64 offset, __u64 size, int mmap_flags);
+int npheap_shm_lock(int devfd, __u64 offset);
+int npheap_shm_lock_timeout(int devfd, __u64 offset, int timeout_ms);
+int npheap_shm_unlock(int devfd, __u64 offset);
+int npheap_shm_delete(int devfd, __u64 offset);
+int npheap_shm_resize(int devfd, __u64 offset, __u64 size);
+long npheap_shm_getsize(int devfd, __u64 offset);
+long npheap_shm_list(int devfd, __u64 *cursor, struct npheap_list_entry *entries, __u64 count);
+long npheap_shm_wait(int devfd, __u64 offset, __u32 last_version, int timeout_ms);
+__u32 *npheap_shm_gen(int devfd, __u64 offset);
+__u32 *npheap_shm_seq(int devfd, __u64 offset);
+void *npheap_shm_window(int devfd, __u64 first, __u64 count, __u64 *stride);
+#endif